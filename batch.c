@@ -0,0 +1,159 @@
+#include "mlisp.h"
+#include <time.h>
+
+/*
+ * Batch mode evaluates many cases in one process. A case file is a
+ * sequence of expressions, each followed by a line holding its expected
+ * output:
+ *
+ *   ; comment
+ *   (+ 1 2)
+ *   => 3
+ *
+ * Every case is evaluated in a fresh environment restored from the
+ * snapshot taken right after initialize(): what a case defines or
+ * assigns, and the coroutines, channels and streams it leaves behind,
+ * are gone for the next one.
+ */
+
+static long elapsed_us(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* skip blanks and comments, return the next char without consuming it */
+static int skip_blank(FILE *fp)
+{
+  int c;
+  while ((c = getc(fp)) != EOF) {
+    if (c == ';') {
+      while ((c = getc(fp)) != EOF && c != '\n')
+        ;
+    } else if (!isspace(c)) {
+      ungetc(c, fp);
+      break;
+    }
+  }
+  return c;
+}
+
+/* read the `=> expected` line following a case */
+static char *read_expected(FILE *fp)
+{
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+
+  skip_blank(fp);
+  if ((len = getline(&line, &cap, fp)) < 0 || strncmp(line, "=>", 2) != 0) {
+    free(line);
+    return NULL;
+  }
+
+  if (len > 0 && line[len - 1] == '\n')
+    line[--len] = '\0';
+
+  char *v = line + 2;
+  while (*v == ' ')
+    v++;
+  memmove(line, v, strlen(v) + 1);
+  return line;
+}
+
+/* resynchronize on the line after the next `=>` when a case can't be parsed */
+static void skip_case(FILE *fp)
+{
+  char *line = NULL;
+  size_t cap = 0;
+
+  while (getline(&line, &cap, fp) >= 0) {
+    char *l = line;
+    while (isspace(*l))
+      l++;
+    if (strncmp(l, "=>", 2) == 0)
+      break;
+  }
+  free(line);
+}
+
+int run_batch(char *path)
+{
+  FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (fp == NULL)
+    error(path);
+
+  int parse_only = get_env_flag("MLISP_PARSE_TEST");
+  print_opt_t opt = default_print_opt();
+  obj_t *env;
+  snapshot_t snap;
+  initialize(&env);
+  save_snapshot(&snap, env);
+
+  FILE *prev = set_parse_input(fp);
+  struct timespec start, total;
+  clock_gettime(CLOCK_MONOTONIC, &total);
+
+  int passed = 0, failed = 0;
+  for (int n = 1; skip_blank(fp) != EOF; n++) {
+    jmp_buf jb;
+    node_t * volatile node = NULL;
+    char * volatile expected = NULL;
+    char * volatile got = NULL;
+    char *err = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    error_handler = &jb;
+    if (setjmp(jb) == 0) {
+      if ((node = parse()) == NULL)
+        error("Unexpected end of input");
+      if ((expected = read_expected(fp)) == NULL)
+        error("Missing `=>` line");
+
+      if (parse_only) {
+        got = sprint_node(node, &opt);
+      } else {
+        env = restore_snapshot(&snap);
+        obj_t *obj = allocation(&env, node);
+        got = sprint_obj(eval(&env, obj), &opt);
+      }
+    } else {
+      err = error_message;
+      if (expected == NULL)
+        skip_case(fp);
+    }
+    error_handler = NULL;
+    long us = elapsed_us(&start);
+    reset_evaluation();
+
+    if (err == NULL && strcmp(expected, got) == 0) {
+      printf("ok %d (%ld us)\n", n, us);
+      passed++;
+    } else {
+      printf("FAIL %d (%ld us): ", n, us);
+      if (node) {
+        fprint_node(stdout, node);
+        printf(": ");
+      }
+      if (err)
+        printf("error: %s\n", err);
+      else
+        printf("`%s` expected, but got `%s`\n", expected, got);
+      failed++;
+    }
+
+    destory_ast(node);
+    free(expected);
+    free(got);
+  }
+
+  set_parse_input(prev);
+  drop_snapshot(&snap);
+  if (fp != stdin)
+    fclose(fp);
+
+  printf("total %.2f ms\n", elapsed_us(&total) / 1000.0);
+  printf("%d passed, %d failed\n", passed, failed);
+  return failed ? 1 : 0;
+}
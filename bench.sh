@@ -0,0 +1,144 @@
+#!/bin/bash
+#
+# Usage: ./bench.sh [-n runs] [-s] [-b baseline] [name ...]
+#        ./bench.sh -r requests
+#
+#   -n runs      run each benchmark this many times (default 5)
+#   -s           save the results as the new baseline
+#   -b baseline  baseline file to compare against (default bench/baseline.txt)
+#   -r requests  time this many small requests to a warm `mlisp -s` server,
+#                over one connection and a connection each, and as many
+#                fresh processes
+#
+# Each benchmark is bench/<name>.lisp. The median wall time, peak RSS and
+# allocation count are reported, and compared against the baseline if any.
+
+runs=5
+save=0
+baseline=bench/baseline.txt
+output=bench_output.txt
+requests=0
+
+fail() {
+    echo -e -n "\033[0;31m[ERROR] \033[0;39m" >&2
+    echo "$1" >&2
+    exit 1
+}
+
+while getopts "n:sb:r:" opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        s) save=1 ;;
+        b) baseline=$OPTARG ;;
+        r) requests=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ "$#" -eq 0 ]; then
+    set -- $(ls bench/*.lisp | xargs -n 1 basename | sed 's/\.lisp$//')
+fi
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : int((v[NR / 2] + v[NR / 2 + 1]) / 2) }'
+}
+
+stat_of() {
+    echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+# prints "<median_us> <maxrss_kb> <allocs>"
+do_bench() {
+    local file="bench/$1.lisp" times="" rss=0 stats=""
+    [ -f "$file" ] || fail "$file not found"
+
+    for i in $(seq "$runs"); do
+        local start=$(date +%s%N)
+        stats=$(MLISP_STATS=1 ./mlisp < "$file" 2>&1 > /dev/null)
+        [ "$?" -ne 0 ] && fail "$1 exited with an error: $stats"
+        local end=$(date +%s%N)
+
+        times="$times $(((end - start) / 1000))"
+        local r=$(stat_of "$stats" maxrss_kb)
+        [ "$r" -gt "$rss" ] && rss=$r
+    done
+
+    echo "$(echo $times | tr ' ' '\n' | median) $rss $(stat_of "$stats" allocs)"
+}
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+# prints the mean microseconds per request of each way to evaluate it
+server_bench() {
+    local dir=$(mktemp -d) req='(fib 15)'
+    local sock="$dir/mlisp.sock" pre="$dir/preload.lisp"
+    echo '(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))' > "$pre"
+
+    ./mlisp -s "$sock" -l "$pre" &
+    local server=$!
+    for i in $(seq 100); do
+        [ -S "$sock" ] && break
+        sleep 0.05
+    done
+    [ -S "$sock" ] || fail "server didn't start"
+
+    local start=$(now_us)
+    yes "$req" | head -n "$requests" | ./mlisp -c "$sock" > /dev/null
+    local one=$(($(now_us) - start))
+
+    start=$(now_us)
+    for i in $(seq "$requests"); do
+        echo "$req" | ./mlisp -c "$sock" > /dev/null
+    done
+    local each=$(($(now_us) - start))
+
+    kill $server
+    wait $server
+
+    start=$(now_us)
+    for i in $(seq "$requests"); do
+        echo "(progn $(cat "$pre") $req)" | ./mlisp > /dev/null
+    done
+    local fresh=$(($(now_us) - start))
+    rm -rf "$dir"
+
+    printf "%-16s %12s\n" mode "us/request"
+    printf "%-16s %12d\n" server $((one / requests))
+    printf "%-16s %12d\n" server_connect $((each / requests))
+    printf "%-16s %12d\n" fresh_process $((fresh / requests))
+}
+
+if [ "$requests" -gt 0 ]; then
+    server_bench
+    exit
+fi
+
+baseline_of() {
+    [ -f "$baseline" ] && awk -v name="$1" '$1 == name { print $2 }' "$baseline"
+}
+
+printf "%-10s %12s %12s %12s %12s\n" name "median(ms)" "rss(KB)" allocs "vs base"
+: > "$output"
+
+for name in "$@"; do
+    read us rss allocs <<< "$(do_bench "$name")" || exit 1
+    [ -z "$us" ] && exit 1
+
+    diff="-"
+    base=$(baseline_of "$name")
+    if [ -n "$base" ] && [ "$base" -gt 0 ]; then
+        diff=$(awk -v a="$us" -v b="$base" 'BEGIN { printf "%+.1f%%", (a - b) * 100 / b }')
+    fi
+
+    printf "%-10s %12s %12s %12s %12s\n" "$name" \
+           "$(awk -v us="$us" 'BEGIN { printf "%.2f", us / 1000 }')" "$rss" "$allocs" "$diff"
+    echo "$name $us $rss $allocs" >> "$output"
+done
+
+if [ "$save" -eq 1 ]; then
+    cp "$output" "$baseline"
+    echo "saved to $baseline"
+fi
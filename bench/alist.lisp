@@ -0,0 +1,14 @@
+(progn
+  (define a1 1) (define a2 2) (define a3 3) (define a4 4) (define a5 5)
+  (define a6 6) (define a7 7) (define a8 8) (define a9 9) (define a10 10)
+  (define b1 1) (define b2 2) (define b3 3) (define b4 4) (define b5 5)
+  (define b6 6) (define b7 7) (define b8 8) (define b9 9) (define b10 10)
+  (define c1 1) (define c2 2) (define c3 3) (define c4 4) (define c5 5)
+  (define c6 6) (define c7 7) (define c8 8) (define c9 9) (define c10 10)
+  (define d1 1) (define d2 2) (define d3 3) (define d4 4) (define d5 5)
+  (define d6 6) (define d7 7) (define d8 8) (define d9 9) (define d10 10)
+  (defun walk (n)
+    (if (= n 0)
+        0
+        (+ a1 a5 a10 b1 b5 b10 c1 c5 c10 d1 d5 d10 (walk (- n 1)))))
+  (walk 400))
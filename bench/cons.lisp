@@ -0,0 +1,10 @@
+(progn
+  (defun iota (n)
+    (if (= n 0)
+        ()
+        (cons n (iota (- n 1)))))
+  (defun build (n)
+    (if (= n 0)
+        ()
+        (cons (iota 20) (build (- n 1)))))
+  (car (build 40)))
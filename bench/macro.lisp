@@ -0,0 +1,9 @@
+(progn
+  (defmacro unless (c then else) (list 'if c else then))
+  (defmacro square (x) (list '* x x))
+  (defmacro inc (x) (list '+ x 1))
+  (defun f (n)
+    (unless (= n 0)
+            (+ (square (inc 1)) (f (- n 1)))
+            0))
+  (f 200))
@@ -0,0 +1,201 @@
+(car (cdr (quote (
+  (0 1 2 3 4 5 6 7 8 9)
+  (sym1 alpha beta gamma delta (nested 1 (deeper 1)) omega)
+  (20 21 22 23 24 25 26 27 28 29)
+  (sym3 alpha beta gamma delta (nested 3 (deeper 3)) omega)
+  (40 41 42 43 44 45 46 47 48 49)
+  (sym5 alpha beta gamma delta (nested 5 (deeper 5)) omega)
+  (60 61 62 63 64 65 66 67 68 69)
+  (sym7 alpha beta gamma delta (nested 7 (deeper 7)) omega)
+  (80 81 82 83 84 85 86 87 88 89)
+  (sym9 alpha beta gamma delta (nested 9 (deeper 9)) omega)
+  (100 101 102 103 104 105 106 107 108 109)
+  (sym11 alpha beta gamma delta (nested 11 (deeper 11)) omega)
+  (120 121 122 123 124 125 126 127 128 129)
+  (sym13 alpha beta gamma delta (nested 13 (deeper 13)) omega)
+  (140 141 142 143 144 145 146 147 148 149)
+  (sym15 alpha beta gamma delta (nested 15 (deeper 15)) omega)
+  (160 161 162 163 164 165 166 167 168 169)
+  (sym17 alpha beta gamma delta (nested 17 (deeper 17)) omega)
+  (180 181 182 183 184 185 186 187 188 189)
+  (sym19 alpha beta gamma delta (nested 19 (deeper 19)) omega)
+  (200 201 202 203 204 205 206 207 208 209)
+  (sym21 alpha beta gamma delta (nested 21 (deeper 21)) omega)
+  (220 221 222 223 224 225 226 227 228 229)
+  (sym23 alpha beta gamma delta (nested 23 (deeper 23)) omega)
+  (240 241 242 243 244 245 246 247 248 249)
+  (sym25 alpha beta gamma delta (nested 25 (deeper 25)) omega)
+  (260 261 262 263 264 265 266 267 268 269)
+  (sym27 alpha beta gamma delta (nested 27 (deeper 27)) omega)
+  (280 281 282 283 284 285 286 287 288 289)
+  (sym29 alpha beta gamma delta (nested 29 (deeper 29)) omega)
+  (300 301 302 303 304 305 306 307 308 309)
+  (sym31 alpha beta gamma delta (nested 31 (deeper 31)) omega)
+  (320 321 322 323 324 325 326 327 328 329)
+  (sym33 alpha beta gamma delta (nested 33 (deeper 33)) omega)
+  (340 341 342 343 344 345 346 347 348 349)
+  (sym35 alpha beta gamma delta (nested 35 (deeper 35)) omega)
+  (360 361 362 363 364 365 366 367 368 369)
+  (sym37 alpha beta gamma delta (nested 37 (deeper 37)) omega)
+  (380 381 382 383 384 385 386 387 388 389)
+  (sym39 alpha beta gamma delta (nested 39 (deeper 39)) omega)
+  (400 401 402 403 404 405 406 407 408 409)
+  (sym41 alpha beta gamma delta (nested 41 (deeper 41)) omega)
+  (420 421 422 423 424 425 426 427 428 429)
+  (sym43 alpha beta gamma delta (nested 43 (deeper 43)) omega)
+  (440 441 442 443 444 445 446 447 448 449)
+  (sym45 alpha beta gamma delta (nested 45 (deeper 45)) omega)
+  (460 461 462 463 464 465 466 467 468 469)
+  (sym47 alpha beta gamma delta (nested 47 (deeper 47)) omega)
+  (480 481 482 483 484 485 486 487 488 489)
+  (sym49 alpha beta gamma delta (nested 49 (deeper 49)) omega)
+  (500 501 502 503 504 505 506 507 508 509)
+  (sym51 alpha beta gamma delta (nested 51 (deeper 51)) omega)
+  (520 521 522 523 524 525 526 527 528 529)
+  (sym53 alpha beta gamma delta (nested 53 (deeper 53)) omega)
+  (540 541 542 543 544 545 546 547 548 549)
+  (sym55 alpha beta gamma delta (nested 55 (deeper 55)) omega)
+  (560 561 562 563 564 565 566 567 568 569)
+  (sym57 alpha beta gamma delta (nested 57 (deeper 57)) omega)
+  (580 581 582 583 584 585 586 587 588 589)
+  (sym59 alpha beta gamma delta (nested 59 (deeper 59)) omega)
+  (600 601 602 603 604 605 606 607 608 609)
+  (sym61 alpha beta gamma delta (nested 61 (deeper 61)) omega)
+  (620 621 622 623 624 625 626 627 628 629)
+  (sym63 alpha beta gamma delta (nested 63 (deeper 63)) omega)
+  (640 641 642 643 644 645 646 647 648 649)
+  (sym65 alpha beta gamma delta (nested 65 (deeper 65)) omega)
+  (660 661 662 663 664 665 666 667 668 669)
+  (sym67 alpha beta gamma delta (nested 67 (deeper 67)) omega)
+  (680 681 682 683 684 685 686 687 688 689)
+  (sym69 alpha beta gamma delta (nested 69 (deeper 69)) omega)
+  (700 701 702 703 704 705 706 707 708 709)
+  (sym71 alpha beta gamma delta (nested 71 (deeper 71)) omega)
+  (720 721 722 723 724 725 726 727 728 729)
+  (sym73 alpha beta gamma delta (nested 73 (deeper 73)) omega)
+  (740 741 742 743 744 745 746 747 748 749)
+  (sym75 alpha beta gamma delta (nested 75 (deeper 75)) omega)
+  (760 761 762 763 764 765 766 767 768 769)
+  (sym77 alpha beta gamma delta (nested 77 (deeper 77)) omega)
+  (780 781 782 783 784 785 786 787 788 789)
+  (sym79 alpha beta gamma delta (nested 79 (deeper 79)) omega)
+  (800 801 802 803 804 805 806 807 808 809)
+  (sym81 alpha beta gamma delta (nested 81 (deeper 81)) omega)
+  (820 821 822 823 824 825 826 827 828 829)
+  (sym83 alpha beta gamma delta (nested 83 (deeper 83)) omega)
+  (840 841 842 843 844 845 846 847 848 849)
+  (sym85 alpha beta gamma delta (nested 85 (deeper 85)) omega)
+  (860 861 862 863 864 865 866 867 868 869)
+  (sym87 alpha beta gamma delta (nested 87 (deeper 87)) omega)
+  (880 881 882 883 884 885 886 887 888 889)
+  (sym89 alpha beta gamma delta (nested 89 (deeper 89)) omega)
+  (900 901 902 903 904 905 906 907 908 909)
+  (sym91 alpha beta gamma delta (nested 91 (deeper 91)) omega)
+  (920 921 922 923 924 925 926 927 928 929)
+  (sym93 alpha beta gamma delta (nested 93 (deeper 93)) omega)
+  (940 941 942 943 944 945 946 947 948 949)
+  (sym95 alpha beta gamma delta (nested 95 (deeper 95)) omega)
+  (960 961 962 963 964 965 966 967 968 969)
+  (sym97 alpha beta gamma delta (nested 97 (deeper 97)) omega)
+  (980 981 982 983 984 985 986 987 988 989)
+  (sym99 alpha beta gamma delta (nested 99 (deeper 99)) omega)
+  (1000 1001 1002 1003 1004 1005 1006 1007 1008 1009)
+  (sym101 alpha beta gamma delta (nested 101 (deeper 101)) omega)
+  (1020 1021 1022 1023 1024 1025 1026 1027 1028 1029)
+  (sym103 alpha beta gamma delta (nested 103 (deeper 103)) omega)
+  (1040 1041 1042 1043 1044 1045 1046 1047 1048 1049)
+  (sym105 alpha beta gamma delta (nested 105 (deeper 105)) omega)
+  (1060 1061 1062 1063 1064 1065 1066 1067 1068 1069)
+  (sym107 alpha beta gamma delta (nested 107 (deeper 107)) omega)
+  (1080 1081 1082 1083 1084 1085 1086 1087 1088 1089)
+  (sym109 alpha beta gamma delta (nested 109 (deeper 109)) omega)
+  (1100 1101 1102 1103 1104 1105 1106 1107 1108 1109)
+  (sym111 alpha beta gamma delta (nested 111 (deeper 111)) omega)
+  (1120 1121 1122 1123 1124 1125 1126 1127 1128 1129)
+  (sym113 alpha beta gamma delta (nested 113 (deeper 113)) omega)
+  (1140 1141 1142 1143 1144 1145 1146 1147 1148 1149)
+  (sym115 alpha beta gamma delta (nested 115 (deeper 115)) omega)
+  (1160 1161 1162 1163 1164 1165 1166 1167 1168 1169)
+  (sym117 alpha beta gamma delta (nested 117 (deeper 117)) omega)
+  (1180 1181 1182 1183 1184 1185 1186 1187 1188 1189)
+  (sym119 alpha beta gamma delta (nested 119 (deeper 119)) omega)
+  (1200 1201 1202 1203 1204 1205 1206 1207 1208 1209)
+  (sym121 alpha beta gamma delta (nested 121 (deeper 121)) omega)
+  (1220 1221 1222 1223 1224 1225 1226 1227 1228 1229)
+  (sym123 alpha beta gamma delta (nested 123 (deeper 123)) omega)
+  (1240 1241 1242 1243 1244 1245 1246 1247 1248 1249)
+  (sym125 alpha beta gamma delta (nested 125 (deeper 125)) omega)
+  (1260 1261 1262 1263 1264 1265 1266 1267 1268 1269)
+  (sym127 alpha beta gamma delta (nested 127 (deeper 127)) omega)
+  (1280 1281 1282 1283 1284 1285 1286 1287 1288 1289)
+  (sym129 alpha beta gamma delta (nested 129 (deeper 129)) omega)
+  (1300 1301 1302 1303 1304 1305 1306 1307 1308 1309)
+  (sym131 alpha beta gamma delta (nested 131 (deeper 131)) omega)
+  (1320 1321 1322 1323 1324 1325 1326 1327 1328 1329)
+  (sym133 alpha beta gamma delta (nested 133 (deeper 133)) omega)
+  (1340 1341 1342 1343 1344 1345 1346 1347 1348 1349)
+  (sym135 alpha beta gamma delta (nested 135 (deeper 135)) omega)
+  (1360 1361 1362 1363 1364 1365 1366 1367 1368 1369)
+  (sym137 alpha beta gamma delta (nested 137 (deeper 137)) omega)
+  (1380 1381 1382 1383 1384 1385 1386 1387 1388 1389)
+  (sym139 alpha beta gamma delta (nested 139 (deeper 139)) omega)
+  (1400 1401 1402 1403 1404 1405 1406 1407 1408 1409)
+  (sym141 alpha beta gamma delta (nested 141 (deeper 141)) omega)
+  (1420 1421 1422 1423 1424 1425 1426 1427 1428 1429)
+  (sym143 alpha beta gamma delta (nested 143 (deeper 143)) omega)
+  (1440 1441 1442 1443 1444 1445 1446 1447 1448 1449)
+  (sym145 alpha beta gamma delta (nested 145 (deeper 145)) omega)
+  (1460 1461 1462 1463 1464 1465 1466 1467 1468 1469)
+  (sym147 alpha beta gamma delta (nested 147 (deeper 147)) omega)
+  (1480 1481 1482 1483 1484 1485 1486 1487 1488 1489)
+  (sym149 alpha beta gamma delta (nested 149 (deeper 149)) omega)
+  (1500 1501 1502 1503 1504 1505 1506 1507 1508 1509)
+  (sym151 alpha beta gamma delta (nested 151 (deeper 151)) omega)
+  (1520 1521 1522 1523 1524 1525 1526 1527 1528 1529)
+  (sym153 alpha beta gamma delta (nested 153 (deeper 153)) omega)
+  (1540 1541 1542 1543 1544 1545 1546 1547 1548 1549)
+  (sym155 alpha beta gamma delta (nested 155 (deeper 155)) omega)
+  (1560 1561 1562 1563 1564 1565 1566 1567 1568 1569)
+  (sym157 alpha beta gamma delta (nested 157 (deeper 157)) omega)
+  (1580 1581 1582 1583 1584 1585 1586 1587 1588 1589)
+  (sym159 alpha beta gamma delta (nested 159 (deeper 159)) omega)
+  (1600 1601 1602 1603 1604 1605 1606 1607 1608 1609)
+  (sym161 alpha beta gamma delta (nested 161 (deeper 161)) omega)
+  (1620 1621 1622 1623 1624 1625 1626 1627 1628 1629)
+  (sym163 alpha beta gamma delta (nested 163 (deeper 163)) omega)
+  (1640 1641 1642 1643 1644 1645 1646 1647 1648 1649)
+  (sym165 alpha beta gamma delta (nested 165 (deeper 165)) omega)
+  (1660 1661 1662 1663 1664 1665 1666 1667 1668 1669)
+  (sym167 alpha beta gamma delta (nested 167 (deeper 167)) omega)
+  (1680 1681 1682 1683 1684 1685 1686 1687 1688 1689)
+  (sym169 alpha beta gamma delta (nested 169 (deeper 169)) omega)
+  (1700 1701 1702 1703 1704 1705 1706 1707 1708 1709)
+  (sym171 alpha beta gamma delta (nested 171 (deeper 171)) omega)
+  (1720 1721 1722 1723 1724 1725 1726 1727 1728 1729)
+  (sym173 alpha beta gamma delta (nested 173 (deeper 173)) omega)
+  (1740 1741 1742 1743 1744 1745 1746 1747 1748 1749)
+  (sym175 alpha beta gamma delta (nested 175 (deeper 175)) omega)
+  (1760 1761 1762 1763 1764 1765 1766 1767 1768 1769)
+  (sym177 alpha beta gamma delta (nested 177 (deeper 177)) omega)
+  (1780 1781 1782 1783 1784 1785 1786 1787 1788 1789)
+  (sym179 alpha beta gamma delta (nested 179 (deeper 179)) omega)
+  (1800 1801 1802 1803 1804 1805 1806 1807 1808 1809)
+  (sym181 alpha beta gamma delta (nested 181 (deeper 181)) omega)
+  (1820 1821 1822 1823 1824 1825 1826 1827 1828 1829)
+  (sym183 alpha beta gamma delta (nested 183 (deeper 183)) omega)
+  (1840 1841 1842 1843 1844 1845 1846 1847 1848 1849)
+  (sym185 alpha beta gamma delta (nested 185 (deeper 185)) omega)
+  (1860 1861 1862 1863 1864 1865 1866 1867 1868 1869)
+  (sym187 alpha beta gamma delta (nested 187 (deeper 187)) omega)
+  (1880 1881 1882 1883 1884 1885 1886 1887 1888 1889)
+  (sym189 alpha beta gamma delta (nested 189 (deeper 189)) omega)
+  (1900 1901 1902 1903 1904 1905 1906 1907 1908 1909)
+  (sym191 alpha beta gamma delta (nested 191 (deeper 191)) omega)
+  (1920 1921 1922 1923 1924 1925 1926 1927 1928 1929)
+  (sym193 alpha beta gamma delta (nested 193 (deeper 193)) omega)
+  (1940 1941 1942 1943 1944 1945 1946 1947 1948 1949)
+  (sym195 alpha beta gamma delta (nested 195 (deeper 195)) omega)
+  (1960 1961 1962 1963 1964 1965 1966 1967 1968 1969)
+  (sym197 alpha beta gamma delta (nested 197 (deeper 197)) omega)
+  (1980 1981 1982 1983 1984 1985 1986 1987 1988 1989)
+  (sym199 alpha beta gamma delta (nested 199 (deeper 199)) omega)))))
@@ -0,0 +1,8 @@
+(progn
+  (defun tak (x y z)
+    (if (< y x)
+        (tak (tak (- x 1) y z)
+             (tak (- y 1) z x)
+             (tak (- z 1) x y))
+        z))
+  (tak 9 6 3))
@@ -0,0 +1,747 @@
+#include "mlisp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+
+/*
+ * Coroutines, scheduled round-robin on one thread.
+ *
+ * (spawn fn args...) calls fn in a new coroutine and returns its id.
+ * Each coroutine has a stack of its own, MLISP_CORO_STACK_SIZE bytes of
+ * address space of which only the pages touched take memory. The
+ * top-level evaluation is coroutine 0. A coroutine runs until it yields,
+ * blocks or returns:
+ *
+ * - (yield) lets the other ready coroutines run first
+ * - (recv ch) waits for a value on a channel, and (send ch v) for room
+ *   on a channel made with a capacity
+ * - (read-line fd) waits with epoll until a line can be read from fd
+ * - (join id) waits for a coroutine to return and returns its value, or
+ *   raises the error it ended with
+ *
+ * Channels and coroutines are referred to by the ints make-channel and
+ * spawn return. A coroutine is freed once it has been joined, or once it
+ * has returned and the collector finds its int unreachable; a channel
+ * once its int is unreachable and no coroutine waits on it. Their ids are
+ * then free for reuse, so keep the int returned, not one computed from
+ * it. When every coroutine is blocked on a channel or a join, coroutine 0
+ * gets a deadlock error.
+ */
+
+#define CORO_STACK_SIZE (256 * 1024)
+#define MAX_EVENTS 64
+
+typedef enum {
+  CORO_READY,
+  CORO_BLOCKED,
+  CORO_DONE
+} coro_state_t;
+
+struct coro_t;
+
+typedef struct queue_t {
+  struct coro_t *head;
+  struct coro_t *tail;
+} queue_t;
+
+typedef struct coro_t {
+  int id;
+  coro_state_t state;
+  ucontext_t ctx;
+  char *stack;                  /* NULL for coroutine 0 */
+  size_t stack_size;
+  void *sp;                     /* stack pointer while switched out */
+  jmp_buf *handler;             /* error_handler while switched out */
+  char *limit;                  /* stack_limit while switched out */
+  unsigned site;                /* gc_site while switched out */
+  obj_t *handle;                /* weak, the int spawn returned, NULL once dead */
+  obj_t *fn;
+  obj_t *args;
+  obj_t *result;
+  char *error;                  /* why it ended, if by an error */
+  queue_t joiners;
+  int joining;                  /* joiners not yet returned */
+  queue_t *waiting;             /* queue it is blocked in */
+  int deadlock;
+  struct coro_t *next;          /* in the run queue or a wait queue */
+} coro_t;
+
+typedef struct channel_t {
+  int id;
+  obj_t *handle;                /* weak, the int make-channel returned */
+  obj_t *head;                  /* values, oldest first */
+  obj_t *tail;
+  size_t len;
+  size_t capacity;              /* 0 for unbounded */
+  int closed;
+  int busy;                     /* sends and recvs in progress, it stays until they end */
+  queue_t receivers;
+  queue_t senders;
+} channel_t;
+
+/* what read-line has read from a fd but not returned yet */
+typedef struct fd_buf_t {
+  char *data;
+  size_t len;
+  size_t cap;
+  int setup;                    /* made non-blocking */
+  int blocking;                 /* was blocking before */
+  int registered;               /* added to the epoll set */
+  int eof;
+  coro_t *waiter;
+} fd_buf_t;
+
+static coro_t **coros;          /* NULL for the ids free again */
+static size_t ncoros;
+static size_t coros_cap;
+static int *free_ids;           /* as many as coros can hold */
+static size_t nfree;
+static coro_t *current;
+static coro_t *zombie;          /* ended, its stack not yet freed */
+static queue_t ready;
+static size_t stack_size;
+
+static channel_t **channels;   /* NULL for the ids free again */
+static size_t nchannels;
+static size_t channels_cap;
+static int *free_channels;
+static size_t nfree_channels;
+
+static int epfd = -1;
+static fd_buf_t *fds;
+static size_t nfds;
+static size_t fd_waiters;
+
+static void enqueue(queue_t *q, coro_t *co)
+{
+  co->next = NULL;
+  if (q->tail)
+    q->tail->next = co;
+  else
+    q->head = co;
+  q->tail = co;
+}
+
+static coro_t *dequeue(queue_t *q)
+{
+  coro_t *co = q->head;
+  if (co) {
+    q->head = co->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+  }
+  return co;
+}
+
+static void unqueue(queue_t *q, coro_t *co)
+{
+  coro_t *prev = NULL;
+  for (coro_t *c = q->head; c; prev = c, c = c->next) {
+    if (c != co)
+      continue;
+    if (prev)
+      prev->next = c->next;
+    else
+      q->head = c->next;
+    if (q->tail == c)
+      q->tail = prev;
+    return;
+  }
+}
+
+static void make_ready(coro_t *co)
+{
+  co->state = CORO_READY;
+  co->waiting = NULL;
+  enqueue(&ready, co);
+}
+
+static void wake(queue_t *q)
+{
+  coro_t *co = dequeue(q);
+  if (co)
+    make_ready(co);
+}
+
+static coro_t *new_coro()
+{
+  if (nfree == 0 && ncoros == coros_cap) {
+    coros_cap = coros_cap ? coros_cap * 2 : 64;
+    coros = realloc(coros, coros_cap * sizeof(coro_t *));
+    free_ids = realloc(free_ids, coros_cap * sizeof(int));
+    if (coros == NULL || free_ids == NULL)
+      error("Failed to allocate coroutine");
+  }
+
+  coro_t *co = calloc(1, sizeof(coro_t));
+  if (co == NULL)
+    error("Failed to allocate coroutine");
+  co->id = nfree ? free_ids[--nfree] : (int)ncoros++;
+  co->state = CORO_READY;
+  coros[co->id] = co;
+  return co;
+}
+
+static void free_coro(coro_t *co)
+{
+  free_ids[nfree++] = co->id;
+  coros[co->id] = NULL;
+  if (co->stack)
+    munmap(co->stack, co->stack_size);
+  free(co->error);
+  free(co);
+}
+
+static void free_channel(channel_t *ch)
+{
+  free_channels[nfree_channels++] = ch->id;
+  channels[ch->id] = NULL;
+  free(ch);
+}
+
+/* a fresh int, not a shared small one, so the collector tells when it is dropped */
+static obj_t *new_handle(obj_t **env, int id)
+{
+  obj_t *obj = allocate(env, T_INT);
+  obj->value = id;
+  return obj;
+}
+
+/* coroutine 0 stands for the top-level evaluation */
+static void setup()
+{
+  if (current)
+    return;
+
+  char *val = getenv("MLISP_CORO_STACK_SIZE");
+  stack_size = (val && val[0]) ? strtoul(val, NULL, 10) : CORO_STACK_SIZE;
+  long page = sysconf(_SC_PAGESIZE);
+  stack_size = (stack_size + page - 1) / page * page;
+  if (stack_size < 4 * (size_t)page)
+    stack_size = 4 * page;
+
+  current = new_coro();
+}
+
+/* free the stack of the coroutine that ended, once off it, and all of it if it can't be joined */
+static void reap()
+{
+  if (zombie && zombie != current) {
+    munmap(zombie->stack, zombie->stack_size);
+    zombie->stack = NULL;
+    if (zombie->handle == NULL && zombie->joining == 0)
+      free_coro(zombie);
+    zombie = NULL;
+  }
+}
+
+static void switch_to(coro_t *co)
+{
+  coro_t *self = current;
+  if (co == self)
+    return;
+
+  char here;
+  self->sp = &here;
+  self->handler = error_handler;
+  self->limit = stack_limit;
+  self->site = gc_site;
+  current = co;
+  swapcontext(&self->ctx, &co->ctx);
+
+  /* resumed */
+  error_handler = self->handler;
+  stack_limit = self->limit;
+  gc_site = self->site;
+  self->sp = NULL;
+  reap();
+}
+
+/* move the coroutines waiting on ready fds to the run queue */
+static void poll_fds(int timeout)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+  if (n < 0 && errno != EINTR)
+    error("Failed to wait for input");
+
+  for (int i = 0; i < n; i++) {
+    fd_buf_t *b = &fds[events[i].data.fd];
+    if (b->waiter) {
+      make_ready(b->waiter);
+      b->waiter = NULL;
+      fd_waiters--;
+    }
+  }
+}
+
+/* run the next ready coroutine, the current one has been queued somewhere */
+static void run_next()
+{
+  for (;;) {
+    coro_t *co = dequeue(&ready);
+    if (co) {
+      switch_to(co);
+      return;
+    }
+
+    if (fd_waiters > 0) {
+      poll_fds(-1);
+    } else {
+      /* nothing can ever wake anyone, fail the top-level evaluation */
+      coros[0]->deadlock = 1;
+      switch_to(coros[0]);
+      return;
+    }
+  }
+}
+
+static void block(queue_t *q)
+{
+  coro_t *self = current;
+  self->state = CORO_BLOCKED;
+  self->waiting = q;
+  enqueue(q, self);
+  run_next();
+
+  if (self->deadlock) {
+    self->deadlock = 0;
+    unqueue(self->waiting, self);
+    self->waiting = NULL;
+    self->state = CORO_READY;
+    error("Deadlock: every coroutine is blocked");
+  }
+}
+
+static void trampoline()
+{
+  coro_t *self = current;
+  jmp_buf jb;
+
+  reap();
+  error_handler = &jb;
+  if (stack_limit)
+    stack_limit = self->stack + self->stack_size / 8;
+  if (setjmp(jb) == 0) {
+    if (self->fn->memo)
+      self->result = memo_call(global_env, self->fn, self->args);
+    else
+      self->result = call_function(global_env, self->fn, self->args);
+  } else {
+    self->error = strdup(error_message);
+  }
+
+  self->fn = self->args = NULL;
+  self->state = CORO_DONE;
+  while (self->joiners.head)
+    wake(&self->joiners);
+
+  zombie = self;
+  run_next();                   /* never comes back */
+}
+
+/* called by the collector to mark stacks other than the running one */
+void *coro_stack_top()
+{
+  return current && current->stack ? current->stack + current->stack_size : NULL;
+}
+
+void coro_mark()
+{
+  for (size_t i = 0; i < ncoros; i++) {
+    coro_t *co = coros[i];
+    if (co == NULL)
+      continue;
+    gc_mark_object(co->fn);
+    gc_mark_object(co->args);
+    gc_mark_object(co->result);
+    if (co == current || co->sp == NULL || co->state == CORO_DONE)
+      continue;
+    gc_mark_range(&co->ctx, &co->ctx + 1);
+    gc_mark_range(co->sp, co->stack ? co->stack + co->stack_size : gc_stack_top());
+  }
+
+  for (size_t i = 0; i < nchannels; i++) {
+    if (channels[i])
+      gc_mark_object(channels[i]->head);
+  }
+}
+
+/* called by the collector once marking is over, to free what can't be named any more */
+void coro_forget_dead()
+{
+  for (size_t i = 0; i < ncoros; i++) {
+    coro_t *co = coros[i];
+    if (co == NULL || co->handle == NULL || gc_is_marked(co->handle))
+      continue;
+    co->handle = NULL;
+    if (co->state == CORO_DONE && co->joining == 0 && co != zombie)
+      free_coro(co);
+  }
+
+  for (size_t i = 0; i < nchannels; i++) {
+    channel_t *ch = channels[i];
+    if (ch == NULL || ch->handle == NULL || gc_is_marked(ch->handle))
+      continue;
+    ch->handle = NULL;
+    if (ch->busy == 0)
+      free_channel(ch);
+  }
+}
+
+static int int_value(obj_t **env, obj_t *arg, char *msg)
+{
+  obj_t *v = eval(env, arg);
+  if (type_of(v) != T_INT)
+    error(msg);
+  return v->value;
+}
+
+static channel_t *channel_of(obj_t *id)
+{
+  if (type_of(id) != T_INT)
+    error("Channel should be an int");
+  if (id->value < 0 || (size_t)id->value >= nchannels || channels[id->value] == NULL)
+    error("No such channel");
+  return channels[id->value];
+}
+
+static channel_t *channel_arg(obj_t **env, obj_t *args)
+{
+  return channel_of(eval(env, args->car));
+}
+
+/* end an operation on ch, freeing it if its int was dropped meanwhile */
+static void release(channel_t *ch)
+{
+  if (--ch->busy == 0 && ch->handle == NULL)
+    free_channel(ch);
+}
+
+obj_t *prim_spawn(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) < 1)
+    error("spawn: Wrong number of arguments");
+
+  obj_t *fn = eval(env, args->car);
+  if (type_of(fn) != T_FUNCTION)
+    error("spawn: Not a function");
+  obj_t *vals = eval_list(env, args->cdr);
+
+  setup();
+  coro_t *co = new_coro();
+  co->stack_size = stack_size;
+  co->stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (co->stack == MAP_FAILED) {
+    co->stack = NULL;
+    co->state = CORO_DONE;
+    error("spawn: Failed to allocate stack");
+  }
+  /* guard page, overflowing the stack faults instead of corrupting memory */
+  mprotect(co->stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+  getcontext(&co->ctx);
+  co->ctx.uc_stack.ss_sp = co->stack;
+  co->ctx.uc_stack.ss_size = stack_size;
+  co->ctx.uc_link = NULL;
+  makecontext(&co->ctx, trampoline, 0);
+
+  co->fn = fn;
+  co->args = vals;
+  enqueue(&ready, co);
+  co->handle = new_handle(env, co->id);
+  return co->handle;
+}
+
+obj_t *prim_yield(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 0)
+    error("yield: Wrong number of arguments");
+
+  setup();
+  if (fd_waiters > 0)
+    poll_fds(0);
+  if (ready.head == NULL)
+    return TRUE;
+
+  make_ready(current);
+  run_next();
+  return TRUE;
+}
+
+obj_t *prim_join(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("join: Wrong number of arguments");
+
+  setup();
+  int id = int_value(env, args->car, "join: Coroutine should be an int");
+  if (id < 0 || (size_t)id >= ncoros || coros[id] == NULL)
+    error("join: No such coroutine");
+  coro_t *co = coros[id];
+  if (co == current)
+    error("join: Can't join itself");
+
+  co->joining++;
+  while (co->state != CORO_DONE)
+    block(&co->joiners);
+  reap();
+  co->joining--;
+
+  /* the last joiner frees it, its stack is gone once off it */
+  static char msg[256];
+  obj_t *result = co->result;
+  char *err = co->error ? strncpy(msg, co->error, sizeof(msg) - 1) : NULL;
+  if (co->joining == 0)
+    free_coro(co);
+  if (err)
+    error(err);
+  return result;
+}
+
+obj_t *prim_make_channel(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) < 0 || length(args) > 1)
+    error("make-channel: Wrong number of arguments");
+
+  int capacity = 0;
+  if (args != NIL && (capacity = int_value(env, args->car, "make-channel: Capacity should be an int")) < 0)
+    error("make-channel: Capacity should not be negative");
+
+  if (nfree_channels == 0 && nchannels == channels_cap) {
+    channels_cap = channels_cap ? channels_cap * 2 : 64;
+    channels = realloc(channels, channels_cap * sizeof(channel_t *));
+    free_channels = realloc(free_channels, channels_cap * sizeof(int));
+    if (channels == NULL || free_channels == NULL)
+      error("Failed to allocate channel");
+  }
+  channel_t *ch = calloc(1, sizeof(channel_t));
+  if (ch == NULL)
+    error("Failed to allocate channel");
+  ch->id = nfree_channels ? free_channels[--nfree_channels] : (int)nchannels++;
+  ch->head = NIL;
+  ch->capacity = capacity;
+  channels[ch->id] = ch;
+  ch->handle = new_handle(env, ch->id);
+  return ch->handle;
+}
+
+obj_t *prim_send(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 2)
+    error("send: Wrong number of arguments");
+
+  setup();
+  obj_t *id = eval(env, args->car);
+  obj_t *v = eval(env, args->cdr->car);
+  channel_t *ch = channel_of(id);
+  ch->busy++;
+  while (!ch->closed && ch->capacity && ch->len >= ch->capacity)
+    block(&ch->senders);
+  if (ch->closed) {
+    release(ch);
+    error("send: Channel is closed");
+  }
+
+  obj_t *cell = new_cell(env, v, NIL);
+  if (ch->tail) {
+    ch->tail->cdr = cell;
+    gc_write_barrier(ch->tail, cell);
+  } else {
+    ch->head = cell;
+  }
+  ch->tail = cell;
+  ch->len++;
+  wake(&ch->receivers);
+  release(ch);
+  return v;
+}
+
+/* the oldest value, or nil once the channel is closed and drained */
+obj_t *prim_recv(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("recv: Wrong number of arguments");
+
+  setup();
+  channel_t *ch = channel_arg(env, args);
+  ch->busy++;
+  while (ch->len == 0 && !ch->closed)
+    block(&ch->receivers);
+
+  obj_t *v = NIL;
+  if (ch->len > 0) {
+    v = ch->head->car;
+    ch->head = ch->head->cdr;
+    if (--ch->len == 0)
+      ch->tail = NULL;
+    wake(&ch->senders);
+  }
+  release(ch);
+  return v;
+}
+
+obj_t *prim_close(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("close: Wrong number of arguments");
+
+  setup();
+  channel_t *ch = channel_arg(env, args);
+  ch->closed = 1;
+  while (ch->receivers.head)
+    wake(&ch->receivers);
+  while (ch->senders.head)
+    wake(&ch->senders);
+  return TRUE;
+}
+
+/* the fds read-line made non-blocking are shared with other processes */
+static void restore_fds()
+{
+  for (size_t i = 0; i < nfds; i++) {
+    int flags;
+    if (fds[i].blocking && (flags = fcntl(i, F_GETFL)) >= 0)
+      fcntl(i, F_SETFL, flags & ~O_NONBLOCK);
+    fds[i].blocking = 0;
+  }
+}
+
+static fd_buf_t *fd_buf(int fd)
+{
+  if ((size_t)fd >= nfds) {
+    size_t n = nfds ? nfds : 16;
+    while (n <= (size_t)fd)
+      n *= 2;
+    fds = realloc(fds, n * sizeof(fd_buf_t));
+    if (fds == NULL)
+      error("Failed to allocate input buffer");
+    memset(fds + nfds, 0, (n - nfds) * sizeof(fd_buf_t));
+    nfds = n;
+  }
+
+  fd_buf_t *b = &fds[fd];
+  if (!b->setup) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+      error("read-line: Bad file descriptor");
+    if (!(flags & O_NONBLOCK)) {
+      static int registered;
+      if (!registered && atexit(restore_fds) == 0)
+        registered = 1;
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+      b->blocking = 1;
+    }
+    b->setup = 1;
+  }
+  return b;
+}
+
+/* block until fd is readable */
+static void wait_fd(int fd, fd_buf_t *b)
+{
+  if (b->waiter)
+    error("read-line: Already being read by another coroutine");
+  if (epfd < 0 && (epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    error("Failed to create epoll instance");
+
+  struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .fd = fd } };
+  if (epoll_ctl(epfd, b->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0) {
+    if (errno == EPERM)
+      return;                   /* regular files are always readable */
+    error("read-line: Failed to wait for input");
+  }
+  b->registered = 1;
+  b->waiter = current;
+  fd_waiters++;
+  current->state = CORO_BLOCKED;
+  run_next();
+}
+
+static obj_t *take_line(obj_t **env, fd_buf_t *b, size_t len, size_t skip)
+{
+  char *str = strndup(b->data, len);
+  memmove(b->data, b->data + len + skip, b->len - len - skip);
+  b->len -= len + skip;
+  return new_string(env, str);
+}
+
+/* the next line without its newline, or nil at the end of input */
+obj_t *prim_read_line(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("read-line: Wrong number of arguments");
+
+  setup();
+  int fd = int_value(env, args->car, "read-line: File descriptor should be an int");
+  if (fd < 0)
+    error("read-line: Bad file descriptor");
+  fd_buf_t *b = fd_buf(fd);
+
+  for (;;) {
+    char *nl = b->len ? memchr(b->data, '\n', b->len) : NULL;
+    if (nl)
+      return take_line(env, b, nl - b->data, 1);
+    if (b->eof)
+      return b->len ? take_line(env, b, b->len, 0) : NIL;
+
+    if (b->len == b->cap) {
+      b->cap = b->cap ? b->cap * 2 : 4096;
+      b->data = realloc(b->data, b->cap);
+      if (b->data == NULL)
+        error("Failed to allocate input buffer");
+    }
+
+    ssize_t n = read(fd, b->data + b->len, b->cap - b->len);
+    if (n > 0)
+      b->len += n;
+    else if (n == 0)
+      b->eof = 1;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      wait_fd(fd, b);
+    else if (errno != EINTR)
+      error("read-line: Failed to read");
+  }
+}
+
+/* drop every coroutine, channel and input buffer */
+void coro_reset()
+{
+  for (size_t i = 0; i < ncoros; i++) {
+    if (coros[i] == NULL)
+      continue;
+    if (coros[i]->stack)
+      munmap(coros[i]->stack, coros[i]->stack_size);
+    free(coros[i]->error);
+    free(coros[i]);
+  }
+  free(coros);
+  free(free_ids);
+  coros = NULL;
+  free_ids = NULL;
+  ncoros = coros_cap = nfree = 0;
+  current = zombie = NULL;
+  ready.head = ready.tail = NULL;
+
+  for (size_t i = 0; i < nchannels; i++)
+    free(channels[i]);
+  free(channels);
+  free(free_channels);
+  channels = NULL;
+  free_channels = NULL;
+  nchannels = channels_cap = nfree_channels = 0;
+
+  restore_fds();
+  for (size_t i = 0; i < nfds; i++)
+    free(fds[i].data);
+  free(fds);
+  fds = NULL;
+  nfds = fd_waiters = 0;
+  if (epfd >= 0)
+    close(epfd);
+  epfd = -1;
+}
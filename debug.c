@@ -1,91 +1,317 @@
 #include "mlisp.h"
 
-void _print_node(node_t *node)
+/* buffered output is written out once it grows past this size */
+#define FLUSH_SIZE 65536
+
+/*
+ * Printers build their output in a growable buffer and walk structures
+ * with an explicit stack, so neither the length nor the nesting of what
+ * they print is limited by the C stack.
+ */
+typedef struct outbuf_t {
+  char *data;
+  size_t len;
+  size_t cap;
+  FILE *fp;                     /* NULL to keep everything in data */
+} outbuf_t;
+
+typedef enum {
+  FRAME_VALUE,                  /* print a value */
+  FRAME_REST                    /* print the rest of a list */
+} frame_kind_t;
+
+typedef struct frame_t {
+  frame_kind_t kind;
+  int depth;
+  int count;                    /* elements already printed (FRAME_REST) */
+  void *ptr;                    /* obj_t or node_t */
+} frame_t;
+
+typedef struct pstack_t {
+  frame_t *frames;
+  size_t len;
+  size_t cap;
+} pstack_t;
+
+static void buf_flush(outbuf_t *buf)
 {
-  switch(node->type) {
-  case NODE_INT:
-    printf("%d", node->value);
-    return;
-  case NODE_SYMBOL:
-    printf("%s", node->name);
-    return;
-  case NODE_CELL:
-    printf("(");
-    node_t *car = node->car;
-    node_t *cdr = node->cdr;
-    _print_node(car);
-
-    if (cdr->type != NODE_NIL && cdr->type != NODE_CELL) {
-      printf(" . ");
-      _print_node(cdr);
-    } else {
-      for (; cdr->type != NODE_NIL; cdr = cdr->cdr) {
-        printf(" ");
-        _print_node(cdr->car);
+  if (buf->fp && buf->len > 0) {
+    fwrite(buf->data, 1, buf->len, buf->fp);
+    buf->len = 0;
+  }
+}
+
+static void buf_write(outbuf_t *buf, const char *s, size_t len)
+{
+  if (buf->len + len + 1 > buf->cap)
+    buf_flush(buf);
+
+  if (buf->len + len + 1 > buf->cap) {
+    while (buf->len + len + 1 > buf->cap)
+      buf->cap = buf->cap ? buf->cap * 2 : FLUSH_SIZE;
+    buf->data = realloc(buf->data, buf->cap);
+    if (buf->data == NULL)
+      error("Failed to allocate print buffer");
+  }
+
+  memcpy(buf->data + buf->len, s, len);
+  buf->len += len;
+  buf->data[buf->len] = '\0';
+
+  if (buf->len >= FLUSH_SIZE)
+    buf_flush(buf);
+}
+
+static void buf_puts(outbuf_t *buf, const char *s)
+{
+  buf_write(buf, s, strlen(s));
+}
+
+static void buf_int(outbuf_t *buf, int v)
+{
+  char s[16];
+  buf_write(buf, s, snprintf(s, sizeof(s), "%d", v));
+}
+
+static void buf_string(outbuf_t *buf, const char *s)
+{
+  buf_puts(buf, "\"");
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      buf_write(buf, "\\", 1);
+    if (*s == '\n')
+      buf_puts(buf, "\\n");
+    else
+      buf_write(buf, s, 1);
+  }
+  buf_puts(buf, "\"");
+}
+
+static void push(pstack_t *st, frame_kind_t kind, void *ptr, int depth, int count)
+{
+  if (st->len == st->cap) {
+    st->cap = st->cap ? st->cap * 2 : 64;
+    st->frames = realloc(st->frames, st->cap * sizeof(frame_t));
+    if (st->frames == NULL)
+      error("Failed to allocate print stack");
+  }
+
+  st->frames[st->len++] = (frame_t) { kind, depth, count, ptr };
+}
+
+/*
+ * Print the separator before the next list element. Returns 0 if the
+ * list is cut off by the length limit instead.
+ */
+static int list_next(outbuf_t *buf, print_opt_t *opt, frame_t *f)
+{
+  if (f->count > 0)
+    buf_puts(buf, " ");
+
+  if (opt->length && f->count >= opt->length) {
+    buf_puts(buf, "...)");
+    return 0;
+  }
+  return 1;
+}
+
+static void _print_node(outbuf_t *buf, print_opt_t *opt, node_t *root)
+{
+  static node_t end = { NODE_NIL };
+  pstack_t st = { NULL, 0, 0 };
+  push(&st, FRAME_VALUE, root, 0, 0);
+
+  while (st.len > 0) {
+    frame_t f = st.frames[--st.len];
+    node_t *node = f.ptr;
+
+    if (f.kind == FRAME_REST) {
+      if (node->type == NODE_NIL) {
+        buf_puts(buf, ")");
+      } else if (node->type != NODE_CELL) {
+        buf_puts(buf, " . ");
+        push(&st, FRAME_REST, &end, f.depth, 0);
+        push(&st, FRAME_VALUE, node, f.depth + 1, 0);
+      } else if (list_next(buf, opt, &f)) {
+        push(&st, FRAME_REST, node->cdr, f.depth, f.count + 1);
+        push(&st, FRAME_VALUE, node->car, f.depth + 1, 0);
       }
+      continue;
     }
 
-    printf(")");
-    return;
-  case NODE_NIL:
-    printf("nil");
-    return;
-  case NODE_TRUE:
-    printf("t");
-    return;
-  default:
-    printf("others(May be error)");
-    return;
+    switch(node->type) {
+    case NODE_INT:
+      buf_int(buf, node->value);
+      break;
+    case NODE_SYMBOL:
+      buf_puts(buf, node->name);
+      break;
+    case NODE_STRING:
+      buf_string(buf, node->name);
+      break;
+    case NODE_CELL:
+      if (opt->depth && f.depth >= opt->depth) {
+        buf_puts(buf, "#");
+      } else {
+        buf_puts(buf, "(");
+        push(&st, FRAME_REST, node, f.depth, 0);
+      }
+      break;
+    case NODE_NIL:
+      buf_puts(buf, "nil");
+      break;
+    case NODE_TRUE:
+      buf_puts(buf, "t");
+      break;
+    default:
+      buf_puts(buf, "others(May be error)");
+      break;
+    }
   }
+
+  free(st.frames);
 }
 
-void _print_obj(obj_t *obj)
+static int is_quote_form(obj_t *obj)
 {
-  switch(obj->type) {
-  case T_INT:
-    printf("%d", obj->value);
-    return;
-  case T_SYMBOL:
-    printf("%s", obj->name);
-    return;
-  case T_PRIMITIVE:
-    printf("(fn () <primtive>)");
-    return;
-  case T_FUNCTION:
-    printf("(fn () <function>)");
-    return;
-  case T_MACRO:
-    printf("(fn () <macro>)");
-    return;
-  case T_CELL:
-    printf("(");
-    _print_obj(obj->car);
-
-    for (obj_t *o = obj->cdr; o->type != T_NIL; o = o->cdr) {
-      if (o->type != T_NIL && o->type != T_CELL) {
-        printf(" . ");
-        _print_obj(o);
-        printf(")");
-        return;
-      } else if (o->type != T_NIL) {
-        printf(" ");
-        _print_obj(o->car);
+  return type_of(obj->car) == T_SYMBOL && strcmp(obj->car->name, "quote") == 0 &&
+    type_of(obj->cdr) == T_CELL && type_of(obj->cdr->cdr) == T_NIL;
+}
+
+static void _print_obj(outbuf_t *buf, print_opt_t *opt, obj_t *root)
+{
+  pstack_t st = { NULL, 0, 0 };
+  push(&st, FRAME_VALUE, root, 0, 0);
+
+  while (st.len > 0) {
+    frame_t f = st.frames[--st.len];
+    obj_t *obj = f.ptr;
+
+    if (f.kind == FRAME_REST) {
+      if (type_of(obj) == T_NIL) {
+        buf_puts(buf, ")");
+      } else if (type_of(obj) != T_CELL) {
+        buf_puts(buf, " . ");
+        push(&st, FRAME_REST, NIL, f.depth, 0);
+        push(&st, FRAME_VALUE, obj, f.depth + 1, 0);
+      } else if (list_next(buf, opt, &f)) {
+        push(&st, FRAME_REST, obj->cdr, f.depth, f.count + 1);
+        push(&st, FRAME_VALUE, obj->car, f.depth + 1, 0);
+      }
+      continue;
+    }
+
+    switch(type_of(obj)) {
+    case T_INT:
+      buf_int(buf, obj->value);
+      break;
+    case T_SYMBOL:
+      buf_puts(buf, obj->name);
+      break;
+    case T_STRING:
+      buf_string(buf, obj->name);
+      break;
+    case T_PRIMITIVE:
+      buf_puts(buf, opt->compact ? "#<primitive>" : "(fn () <primtive>)");
+      break;
+    case T_FUNCTION:
+      buf_puts(buf, opt->compact ? "#<function>" : "(fn () <function>)");
+      break;
+    case T_MACRO:
+      buf_puts(buf, opt->compact ? "#<macro>" : "(fn () <macro>)");
+      break;
+    case T_PROMISE:
+      buf_puts(buf, "#<promise>");
+      break;
+    case T_CELL:
+      if (opt->depth && f.depth >= opt->depth) {
+        buf_puts(buf, "#");
+      } else if (opt->compact && is_quote_form(obj)) {
+        buf_puts(buf, "'");
+        push(&st, FRAME_VALUE, obj->cdr->car, f.depth, 0);
       } else {
-        error("An error in print_obj");
+        buf_puts(buf, "(");
+        push(&st, FRAME_REST, obj, f.depth, 0);
       }
+      break;
+    case T_MOVED:
+      buf_puts(buf, "TMOVED\n");
+      break;
+    case T_NIL:
+      buf_puts(buf, "()");
+      break;
+    case T_TRUE:
+      buf_puts(buf, "t");
+      break;
+    default:
+      buf_puts(buf, "others(May be error)");
+      break;
     }
-    printf(")");
-    return;
-  case T_MOVED:
-    puts("TMOVED");
-    return;
-  case T_NIL:
-    printf("()");
+  }
+
+  free(st.frames);
+}
+
+static int env_int(char *name)
+{
+  char *val = getenv(name);
+  return val ? atoi(val) : 0;
+}
+
+/* options set by MLISP_PRINT_LENGTH, MLISP_PRINT_DEPTH and MLISP_PRINT_COMPACT */
+print_opt_t default_print_opt()
+{
+  return (print_opt_t) {
+    env_int("MLISP_PRINT_LENGTH"),
+    env_int("MLISP_PRINT_DEPTH"),
+    get_env_flag("MLISP_PRINT_COMPACT")
+  };
+}
+
+void fprint_obj_opt(FILE *fp, obj_t *obj, print_opt_t *opt)
+{
+  if (obj == NULL)
     return;
-  case T_TRUE:
-    printf("t");
+
+  outbuf_t buf = { NULL, 0, 0, fp };
+  _print_obj(&buf, opt, obj);
+  buf_flush(&buf);
+  free(buf.data);
+}
+
+void fprint_obj(FILE *fp, obj_t *obj)
+{
+  print_opt_t opt = default_print_opt();
+  fprint_obj_opt(fp, obj, &opt);
+}
+
+void fprint_node(FILE *fp, node_t *node)
+{
+  if (node == NULL)
     return;
-  }
+
+  print_opt_t opt = default_print_opt();
+  outbuf_t buf = { NULL, 0, 0, fp };
+  _print_node(&buf, &opt, node);
+  buf_flush(&buf);
+  free(buf.data);
+}
+
+/* print into a newly allocated string */
+char *sprint_obj(obj_t *obj, print_opt_t *opt)
+{
+  outbuf_t buf = { NULL, 0, 0, NULL };
+  buf_write(&buf, "", 0);
+  _print_obj(&buf, opt, obj);
+  return buf.data;
+}
+
+char *sprint_node(node_t *node, print_opt_t *opt)
+{
+  outbuf_t buf = { NULL, 0, 0, NULL };
+  buf_write(&buf, "", 0);
+  _print_node(&buf, opt, node);
+  return buf.data;
 }
 
 void print_obj(obj_t *obj)
@@ -93,7 +319,7 @@ void print_obj(obj_t *obj)
   if (obj == NULL)
     return;
 
-  _print_obj(obj);
+  fprint_obj(stdout, obj);
   puts("");
 }
 
@@ -102,6 +328,6 @@ void print_node(node_t *node)
   if (node == NULL)
     return;
 
-  _print_node(node);
+  fprint_node(stdout, node);
   puts("");
 }
@@ -0,0 +1,260 @@
+#define _GNU_SOURCE             /* pthread_getattr_np() */
+#include "mlisp.h"
+#include "libmlisp.h"
+#include <pthread.h>
+
+/* the embedding API, see libmlisp.h */
+
+#define STACK_RESERVE (256 * 1024)  /* left for error handling and the collector */
+
+struct mlisp_t {
+  obj_t *env;                   /* the global environment */
+  char *error;                  /* why the last call failed */
+  int depth;                    /* calls into the interpreter in progress */
+};
+
+static mlisp_t *instance;
+
+static void set_error(mlisp_t *m, const char *msg)
+{
+  free(m->error);
+  m->error = strdup(msg ? msg : "");
+}
+
+/*
+ * The lowest address evaluation may use on the calling thread's stack,
+ * so that runaway recursion fails the call instead of the host.
+ */
+static char *thread_stack_limit()
+{
+  pthread_attr_t attr;
+  void *addr;
+  size_t size;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0)
+    return NULL;
+  int ok = pthread_attr_getstack(&attr, &addr, &size) == 0;
+  pthread_attr_destroy(&attr);
+  if (!ok)
+    return NULL;
+
+  size_t reserve = size / 4 < STACK_RESERVE ? size / 4 : STACK_RESERVE;
+  return (char *)addr + reserve;
+}
+
+/*
+ * Run f(m, arg) with errors caught. Only objects below the outermost call
+ * are scanned as roots, the host's own frames aren't.
+ */
+static int guarded(mlisp_t *m, void (*f)(mlisp_t *, void *), void *arg)
+{
+  jmp_buf jb, *prev = error_handler;
+  char *prev_limit = stack_limit;
+  volatile int depth = m->depth;
+
+  if (m->depth++ == 0) {
+    gc_set_stack_top(&jb + 1);
+    stack_limit = thread_stack_limit();
+  }
+  error_handler = &jb;
+  int status = MLISP_OK;
+  if (setjmp(jb) == 0) {
+    f(m, arg);
+  } else {
+    set_error(m, error_message);
+    status = MLISP_ERROR;
+  }
+
+  error_handler = prev;
+  stack_limit = prev_limit;
+  m->depth = depth;
+  return status;
+}
+
+static void create(mlisp_t *m, void *arg)
+{
+  initialize(&m->env);
+}
+
+mlisp_t *mlisp_create()
+{
+  if (instance != NULL)
+    return NULL;
+
+  mlisp_t *m = calloc(1, sizeof(mlisp_t));
+  if (m == NULL)
+    return NULL;
+  if (guarded(m, create, NULL) != MLISP_OK) {
+    deinitialize();
+    free(m->error);
+    free(m);
+    return NULL;
+  }
+  instance = m;
+  return m;
+}
+
+void mlisp_destroy(mlisp_t *m)
+{
+  if (m == NULL || m != instance)
+    return;
+
+  deinitialize();
+  free(m->error);
+  free(m);
+  instance = NULL;
+}
+
+typedef struct eval_arg_t {
+  const char *src;
+  size_t len;
+  obj_t **result;
+} eval_arg_t;
+
+static void eval_forms(mlisp_t *m, void *arg)
+{
+  eval_arg_t *a = arg;
+  *a->result = eval_string(global_env, a->src, a->len);
+}
+
+int mlisp_eval(mlisp_t *m, const char *src, size_t len, obj_t **result)
+{
+  obj_t *ignored;
+  eval_arg_t a = { src, len, result ? result : &ignored };
+  return guarded(m, eval_forms, &a);
+}
+
+const char *mlisp_error(mlisp_t *m)
+{
+  return m->error ? m->error : "";
+}
+
+typedef struct define_arg_t {
+  const char *name;
+  primitive_t *fn;
+} define_arg_t;
+
+static void define(mlisp_t *m, void *arg)
+{
+  define_arg_t *a = arg;
+  define_primitives((char *)a->name, a->fn, global_env);
+}
+
+int mlisp_define_primitive(mlisp_t *m, const char *name, primitive_t *fn)
+{
+  define_arg_t a = { name, fn };
+  return guarded(m, define, &a);
+}
+
+void mlisp_protect(mlisp_t *m, obj_t **var)
+{
+  gc_add_root(var);
+}
+
+void mlisp_unprotect(mlisp_t *m, obj_t **var)
+{
+  gc_remove_root(var);
+}
+
+int mlisp_is_nil(obj_t *obj)
+{
+  return type_of(obj) == T_NIL;
+}
+
+int mlisp_is_int(obj_t *obj)
+{
+  return type_of(obj) == T_INT;
+}
+
+int mlisp_is_symbol(obj_t *obj)
+{
+  return type_of(obj) == T_SYMBOL;
+}
+
+int mlisp_is_string(obj_t *obj)
+{
+  return type_of(obj) == T_STRING;
+}
+
+int mlisp_is_cell(obj_t *obj)
+{
+  return type_of(obj) == T_CELL;
+}
+
+int mlisp_int_value(obj_t *obj)
+{
+  return mlisp_is_int(obj) ? obj->value : 0;
+}
+
+const char *mlisp_symbol_name(obj_t *obj)
+{
+  return mlisp_is_symbol(obj) ? obj->name : NULL;
+}
+
+const char *mlisp_string_value(obj_t *obj)
+{
+  return mlisp_is_string(obj) ? obj->name : NULL;
+}
+
+obj_t *mlisp_car(obj_t *obj)
+{
+  return mlisp_is_cell(obj) ? obj->car : NIL;
+}
+
+obj_t *mlisp_cdr(obj_t *obj)
+{
+  return mlisp_is_cell(obj) ? obj->cdr : NIL;
+}
+
+int mlisp_length(obj_t *obj)
+{
+  int n = 0;
+  for (; mlisp_is_cell(obj); obj = obj->cdr)
+    n++;
+  return n;
+}
+
+char *mlisp_print(obj_t *obj)
+{
+  print_opt_t opt = default_print_opt();
+  return sprint_obj(obj, &opt);
+}
+
+obj_t *mlisp_eval_arg(obj_t **env, obj_t *arg)
+{
+  return eval(env, arg);
+}
+
+obj_t *mlisp_nil()
+{
+  return NIL;
+}
+
+obj_t *mlisp_true()
+{
+  return TRUE;
+}
+
+obj_t *mlisp_make_int(obj_t **env, int v)
+{
+  return new_int(env, v);
+}
+
+obj_t *mlisp_make_string(obj_t **env, const char *str)
+{
+  return new_string(env, strdup(str));
+}
+
+obj_t *mlisp_make_symbol(obj_t **env, const char *name)
+{
+  return intern(env, (char *)name);
+}
+
+obj_t *mlisp_cons(obj_t **env, obj_t *car, obj_t *cdr)
+{
+  return new_cell(env, car, cdr);
+}
+
+void mlisp_raise(const char *msg)
+{
+  error((char *)msg);
+}
@@ -0,0 +1,710 @@
+#include "mlisp.h"
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * Non-moving mark & sweep collector.
+ *
+ * The heap is a set of MEMORY_SIZE aligned pages, added as allocation
+ * needs them up to MLISP_HEAP_SIZE bytes. Each page holds objects of a
+ * single type, so objects carry no header: a cons cell is two pointers,
+ * an int or a symbol one word. The page header records the type (see
+ * type_of()) and two bitmaps with a bit per slot, one for the slots in
+ * use and one for marking. Sweeping a page is a pass over the bitmaps.
+ *
+ * The roots are the variables registered with gc_add_root() and a
+ * conservative scan of the C stacks and registers, so the interpreter can
+ * keep objects in local variables. Each coroutine has a stack, see coro.c.
+ *
+ * A collection starts once as many objects have been allocated as were
+ * live after the previous one. By default it marks and sweeps the whole
+ * heap at once. With MLISP_GC_INCREMENTAL the work is split into slices
+ * run every GC_SLICE_ALLOCS allocations, each stopping after
+ * MLISP_GC_PAUSE_US microseconds:
+ *
+ * - marking is tri-color: gray objects wait on the mark stack, and
+ *   gc_write_barrier() grays a white object stored into a marked one.
+ *   Objects allocated while marking are black. The roots are scanned
+ *   again, all at once, before marking ends.
+ * - pages are swept lazily, by the slices or when allocation reaches
+ *   them.
+ */
+
+#define GC_MIN_INTERVAL 16384   /* allocations between two collections */
+#define GC_SLICE_ALLOCS 256
+#define GC_DEFAULT_PAUSE_US 1000
+#define HEAP_LIMIT (1UL << 30)
+
+#define MIN_SLOT_SHIFT 3
+#define BITMAP_WORDS (MEMORY_SIZE >> MIN_SLOT_SHIFT >> 6)
+
+typedef struct page_t {
+  type_t type;                  /* must come first, see type_of() */
+  int shift;                    /* log2 of the slot size */
+  size_t nslots;
+  size_t cursor;                /* bitmap word to look for free slots from */
+  int swept;                    /* already swept in this cycle */
+  struct page_t *next;          /* next page of the same type */
+  uint16_t *sites;              /* allocation site of each slot, see prof.c */
+  uint64_t used[BITMAP_WORDS];
+  uint64_t mark[BITMAP_WORDS];
+} page_t;
+
+#define PAGE_HEADER ((sizeof(page_t) + 31) & ~(size_t)31)
+#define SLOTS(pg) ((char *)(pg) + PAGE_HEADER)
+
+/* log2 of the slot size of each type */
+static const int slot_shift[T_NTYPES] = {
+  [T_INT] = 3,
+  [T_SYMBOL] = 3,
+  [T_STRING] = 3,
+  [T_PRIMITIVE] = 3,
+  [T_MACRO] = 6,
+  [T_FUNCTION] = 6,
+  [T_CELL] = 4,
+  [T_PROMISE] = 4,
+  [T_MOVED] = 3,
+  [T_NIL] = 4,                  /* car and cdr of nil read as NULL */
+  [T_TRUE] = 4,
+};
+
+typedef enum {
+  GC_IDLE,
+  GC_MARKING,
+  GC_SWEEPING
+} gc_phase_t;
+
+/* stack top of the main thread, exported by glibc */
+extern void *__libc_stack_end;
+
+static void *stack_top;         /* where the scan stops, see gc_set_stack_top() */
+
+int GC_LOCK;
+
+int heap_profiling;             /* MLISP_HEAP_PROFILE, record allocation sites */
+unsigned gc_site;               /* site of the allocations being made */
+
+/* statistics, reported with MLISP_STATS */
+size_t stat_allocs;
+size_t stat_bytes;
+size_t stat_gcs;
+long stat_gc_max_pause_us;
+long stat_gc_total_us;
+
+static page_t **all_pages;      /* sorted by address */
+static size_t npages;
+static size_t max_pages;
+static page_t *pages[T_NTYPES];       /* pages of each type */
+static page_t *alloc_page[T_NTYPES];  /* where allocation looks first */
+
+static gc_phase_t phase;
+static size_t sweep_index;
+static size_t live_slots;
+static size_t allocs_since_gc;
+static size_t next_gc;
+
+static obj_t **gray;
+static size_t ngray;
+static size_t gray_cap;
+
+static obj_t ***roots;
+static size_t nroots;
+static size_t roots_cap;
+
+static size_t alloc_limit;      /* stat_allocs allocate() fails at, 0 for none */
+
+static int configured;
+static int incremental;
+static long pause_us;
+static size_t min_interval;
+static int slice_allocs;
+
+static long now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t env_size(char *name, size_t def)
+{
+  char *val = getenv(name);
+  return (val && val[0]) ? strtoul(val, NULL, 10) : def;
+}
+
+static void configure()
+{
+  configured = 1;
+  incremental = get_env_flag("MLISP_GC_INCREMENTAL");
+  heap_profiling = get_env_flag("MLISP_HEAP_PROFILE");
+  pause_us = env_size("MLISP_GC_PAUSE_US", GC_DEFAULT_PAUSE_US);
+  min_interval = env_size("MLISP_GC_MIN_INTERVAL", GC_MIN_INTERVAL);
+  if (min_interval < 1)
+    min_interval = 1;
+  next_gc = min_interval;
+
+  max_pages = env_size("MLISP_HEAP_SIZE", HEAP_LIMIT) / MEMORY_SIZE;
+  if (max_pages < T_NTYPES)
+    max_pages = T_NTYPES;
+}
+
+void gc_add_root(obj_t **root)
+{
+  if (nroots == roots_cap) {
+    roots_cap = roots_cap ? roots_cap * 2 : 16;
+    roots = realloc(roots, roots_cap * sizeof(obj_t **));
+    if (roots == NULL)
+      error("Failed to allocate gc roots");
+  }
+  roots[nroots++] = root;
+}
+
+void gc_remove_root(obj_t **root)
+{
+  for (size_t i = 0; i < nroots; i++) {
+    if (roots[i] == root) {
+      roots[i] = roots[--nroots];
+      return;
+    }
+  }
+}
+
+static inline page_t *page_of(obj_t *obj)
+{
+  return (page_t *)((uintptr_t)obj & ~(uintptr_t)(MEMORY_SIZE - 1));
+}
+
+static inline size_t slot_of(page_t *pg, obj_t *obj)
+{
+  return ((char *)obj - SLOTS(pg)) >> pg->shift;
+}
+
+static inline int test_bit(uint64_t *bits, size_t i)
+{
+  return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static inline void set_bit(uint64_t *bits, size_t i)
+{
+  bits[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static page_t *add_page(type_t type)
+{
+  if (npages >= max_pages)
+    return NULL;
+
+  /* map twice the size to cut an aligned page out of it */
+  char *p = mmap(NULL, MEMORY_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  char *start = (char *)(((uintptr_t)p + MEMORY_SIZE - 1) & ~(uintptr_t)(MEMORY_SIZE - 1));
+  if (start > p)
+    munmap(p, start - p);
+  if (start + MEMORY_SIZE < p + MEMORY_SIZE * 2)
+    munmap(start + MEMORY_SIZE, p + MEMORY_SIZE * 2 - (start + MEMORY_SIZE));
+
+  all_pages = realloc(all_pages, (npages + 1) * sizeof(page_t *));
+  if (all_pages == NULL)
+    error("Failed to allocate heap pages");
+
+  size_t i = npages;
+  for (; i > 0 && all_pages[i - 1] > (page_t *)start; i--)
+    all_pages[i] = all_pages[i - 1];
+  all_pages[i] = (page_t *)start;
+  npages++;
+  if (phase == GC_SWEEPING && i < sweep_index)
+    sweep_index++;
+
+  /* fresh pages from mmap are zeroed: nothing used or marked */
+  page_t *pg = all_pages[i];
+  pg->type = type;
+  pg->shift = slot_shift[type];
+  pg->nslots = (MEMORY_SIZE - PAGE_HEADER) >> pg->shift;
+  pg->swept = 1;
+  pg->next = pages[type];
+  pages[type] = pg;
+  if (heap_profiling)
+    pg->sites = calloc(pg->nslots, sizeof(uint16_t));
+  return pg;
+}
+
+/* the live object p points into, or NULL */
+static obj_t *heap_object(void *p)
+{
+  page_t *pg = page_of(p);
+  size_t lo = 0, hi = npages;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (all_pages[mid] < pg)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == npages || all_pages[lo] != pg || (char *)p < SLOTS(pg))
+    return NULL;
+
+  size_t i = slot_of(pg, p);
+  if (i >= pg->nslots || !test_bit(pg->used, i))
+    return NULL;
+  return (obj_t *)(SLOTS(pg) + (i << pg->shift));
+}
+
+int gc_is_marked(obj_t *obj)
+{
+  page_t *pg = page_of(obj);
+  return test_bit(pg->mark, slot_of(pg, obj));
+}
+
+/* gray a white object */
+void gc_mark_object(obj_t *obj)
+{
+  if (obj == NULL)
+    return;
+
+  page_t *pg = page_of(obj);
+  size_t i = slot_of(pg, obj);
+  if (test_bit(pg->mark, i))
+    return;
+
+  set_bit(pg->mark, i);
+  if (ngray == gray_cap) {
+    gray_cap = gray_cap ? gray_cap * 2 : 1024;
+    gray = realloc(gray, gray_cap * sizeof(obj_t *));
+    if (gray == NULL)
+      error("Failed to allocate mark stack");
+  }
+  gray[ngray++] = obj;
+}
+
+void gc_write_barrier(obj_t *parent, obj_t *child)
+{
+  if (phase == GC_MARKING && gc_is_marked(parent))
+    gc_mark_object(child);
+}
+
+/* blacken a gray object */
+static void scan(obj_t *obj)
+{
+  switch (type_of(obj)) {
+  case T_CELL:
+  case T_PROMISE:
+    gc_mark_object(obj->car);
+    gc_mark_object(obj->cdr);
+    break;
+  case T_FUNCTION:
+  case T_MACRO:
+    gc_mark_object(obj->args);
+    gc_mark_object(obj->body);
+    gc_mark_object(obj->captured);
+    gc_mark_object(obj->sym);
+    if (obj->jit)
+      jit_mark(obj->jit);
+    break;
+  default:
+    break;
+  }
+}
+
+/* mark whatever the words in [lo, hi) may point to */
+void gc_mark_range(void *lo, void *hi)
+{
+  void **p = (void **)(((uintptr_t)lo + sizeof(void *) - 1) & ~(uintptr_t)(sizeof(void *) - 1));
+  for (; (void *)(p + 1) <= hi; p++) {
+    obj_t *obj = heap_object(*p);
+    if (obj)
+      gc_mark_object(obj);
+  }
+}
+
+static void __attribute__((noinline)) mark_stack()
+{
+  jmp_buf regs;
+  __builtin_unwind_init();      /* spill callee-saved registers */
+  setjmp(regs);
+
+  /* the running coroutine's stack, then those of the suspended ones */
+  void *top = coro_stack_top();
+  gc_mark_range(&regs, top ? top : gc_stack_top());
+  coro_mark();
+}
+
+/*
+ * An embedding host calling in from another thread, or holding objects
+ * it doesn't want scanned, sets the top of the stack to scan for roots.
+ * NULL means the main thread's stack top.
+ */
+void gc_set_stack_top(void *top)
+{
+  stack_top = top;
+}
+
+void *gc_stack_top()
+{
+  return stack_top ? stack_top : __libc_stack_end;
+}
+
+static void mark_roots()
+{
+  for (size_t i = 0; i < nroots; i++)
+    gc_mark_object(*roots[i]);
+  mark_stack();
+}
+
+static void start_cycle()
+{
+  phase = GC_MARKING;
+  mark_roots();
+}
+
+/* everything reachable is marked, start sweeping */
+static void finish_marking()
+{
+  memo_forget_dead();
+  capture_forget_dead();
+  coro_forget_dead();
+
+  phase = GC_SWEEPING;
+  sweep_index = 0;
+  live_slots = 0;
+  for (size_t i = 0; i < npages; i++)
+    all_pages[i]->swept = 0;
+  for (int t = 0; t < T_NTYPES; t++)
+    alloc_page[t] = pages[t];
+}
+
+static void finalize(obj_t *obj, type_t type)
+{
+  switch (type) {
+  case T_SYMBOL:
+  case T_STRING:
+    free(obj->name);
+    break;
+  case T_FUNCTION:
+    free(obj->jit);
+    memo_free(obj->memo);
+    break;
+  default:
+    break;
+  }
+}
+
+/* what is used but not marked is garbage, what is marked stays in use */
+static void sweep_page(page_t *pg)
+{
+  int finalized = pg->type == T_SYMBOL || pg->type == T_STRING || pg->type == T_FUNCTION;
+  size_t words = (pg->nslots + 63) >> 6;
+
+  for (size_t w = 0; w < words; w++) {
+    uint64_t dead = pg->used[w] & ~pg->mark[w];
+    for (; finalized && dead; dead &= dead - 1) {
+      size_t i = (w << 6) + __builtin_ctzll(dead);
+      finalize((obj_t *)(SLOTS(pg) + (i << pg->shift)), pg->type);
+    }
+    pg->used[w] = pg->mark[w];
+    pg->mark[w] = 0;
+    live_slots += __builtin_popcountll(pg->used[w]);
+  }
+  pg->cursor = 0;
+  pg->swept = 1;
+}
+
+/* sweep the next page, returns 0 when the cycle is over */
+static int sweep_next()
+{
+  while (sweep_index < npages && all_pages[sweep_index]->swept)
+    sweep_index++;
+
+  if (sweep_index == npages) {
+    phase = GC_IDLE;
+    stat_gcs++;
+    allocs_since_gc = 0;
+    next_gc = live_slots < min_interval ? min_interval : live_slots;
+    return 0;
+  }
+
+  sweep_page(all_pages[sweep_index++]);
+  return 1;
+}
+
+/* do collection work for about budget microseconds, or to the end when negative */
+static void gc_step(long budget)
+{
+  long start = now_us();
+  int n = 0;
+
+  while (phase != GC_IDLE) {
+    if (phase == GC_MARKING) {
+      /*
+       * The mutator may have changed the roots since marking started:
+       * rescan them, and only when that grays nothing is marking over.
+       * Whatever it does gray is scanned within the budget as usual.
+       */
+      if (ngray == 0) {
+        mark_roots();
+        if (ngray == 0)
+          finish_marking();
+      } else {
+        scan(gray[--ngray]);
+      }
+      if ((++n & 255) != 0)
+        continue;
+    } else if (!sweep_next()) {
+      break;
+    }
+
+    if (budget >= 0 && now_us() - start >= budget)
+      break;
+  }
+
+  long pause = now_us() - start;
+  stat_gc_total_us += pause;
+  if (pause > stat_gc_max_pause_us)
+    stat_gc_max_pause_us = pause;
+}
+
+void gc()
+{
+  if (GC_LOCK)
+    return;
+
+  if (phase == GC_IDLE)
+    start_cycle();
+  gc_step(-1);
+}
+
+/* take a free slot of pg, sweeping it first if needed */
+static obj_t *page_alloc(page_t *pg)
+{
+  if (!pg->swept)
+    sweep_page(pg);
+
+  size_t words = (pg->nslots + 63) >> 6;
+  for (; pg->cursor < words; pg->cursor++) {
+    uint64_t free = ~pg->used[pg->cursor];
+    if (free == 0)
+      continue;
+
+    size_t i = (pg->cursor << 6) + __builtin_ctzll(free);
+    if (i >= pg->nslots)
+      break;
+    set_bit(pg->used, i);
+    if (phase == GC_MARKING)
+      set_bit(pg->mark, i);
+    if (pg->sites)
+      pg->sites[i] = gc_site;
+    return (obj_t *)(SLOTS(pg) + (i << pg->shift));
+  }
+  return NULL;
+}
+
+static obj_t *take(type_t type)
+{
+  obj_t *obj = NULL;
+  for (page_t *pg = alloc_page[type]; pg != NULL; pg = alloc_page[type] = pg->next) {
+    if ((obj = page_alloc(pg)) != NULL)
+      return obj;
+  }
+
+  page_t *pg = add_page(type);
+  if (pg != NULL) {
+    alloc_page[type] = pg;
+    return page_alloc(pg);
+  }
+  return NULL;
+}
+
+obj_t *allocate(obj_t **env, type_t type)
+{
+  if (!configured)
+    configure();
+  if (alloc_limit && stat_allocs >= alloc_limit)
+    error("Allocation limit exceeded");
+
+  if (!GC_LOCK) {
+    if (phase == GC_IDLE && allocs_since_gc >= next_gc) {
+      start_cycle();
+      if (!incremental)
+        gc_step(-1);
+    } else if (phase != GC_IDLE && ++slice_allocs >= GC_SLICE_ALLOCS) {
+      slice_allocs = 0;
+      gc_step(pause_us);
+    }
+  }
+
+  obj_t *obj = take(type);
+  if (obj == NULL && !GC_LOCK) {
+    /* the heap is at its limit */
+    gc();
+    obj = take(type);
+  }
+  if (obj == NULL)
+    error("Out of memory");
+
+  allocs_since_gc++;
+  stat_allocs++;
+  stat_bytes += (size_t)1 << slot_shift[type];
+  return obj;
+}
+
+size_t gc_heap_size()
+{
+  return npages * MEMORY_SIZE;
+}
+
+/* fail allocations after n more of them, or never for 0 */
+void gc_set_alloc_limit(size_t n)
+{
+  alloc_limit = n ? stat_allocs + n : 0;
+}
+
+/* the size of an object, with the string it owns */
+static size_t object_bytes(page_t *pg, obj_t *obj)
+{
+  size_t n = (size_t)1 << pg->shift;
+  if (pg->type == T_SYMBOL || pg->type == T_STRING)
+    n += strlen(obj->name) + 1;
+  return n;
+}
+
+/* collect the whole heap, then call fn on every object left */
+void gc_each_object(void (*fn)(obj_t *obj, size_t bytes, unsigned site, void *arg), void *arg)
+{
+  /* a cycle in progress keeps what died since it started */
+  if (phase != GC_IDLE)
+    gc();
+  gc();
+
+  for (size_t i = 0; i < npages; i++) {
+    page_t *pg = all_pages[i];
+    for (size_t j = 0; j < pg->nslots; j++) {
+      if (!test_bit(pg->used, j))
+        continue;
+      obj_t *obj = (obj_t *)(SLOTS(pg) + (j << pg->shift));
+      fn(obj, object_bytes(pg, obj), pg->sites ? pg->sites[j] : 0, arg);
+    }
+  }
+}
+
+static size_t page_index(page_t *pg)
+{
+  size_t lo = 0, hi = npages;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (all_pages[mid] < pg)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+#define OWNER_SHARED UINT32_MAX
+
+/*
+ * Store in bytes[i] the size of what only vals[i] keeps alive, that is
+ * what the roots reach through vals[i] and no other way. The caller takes
+ * vals out of the heap first, right after a collection, and puts them
+ * back afterwards. Like collection, it sees stale pointers on the stack.
+ */
+void gc_retained(obj_t **vals, size_t n, size_t *bytes)
+{
+  if (phase != GC_IDLE)
+    error("Collection in progress");
+
+  /* mark what is alive without vals */
+  mark_roots();
+  while (ngray > 0)
+    scan(gray[--ngray]);
+
+  /* then claim the rest for the first val that reaches it, or for none */
+  uint32_t **owners = calloc(npages, sizeof(uint32_t *));
+  obj_t **stack = NULL;
+  size_t depth = 0, cap = 0;
+  if (owners == NULL)
+    error("Failed to allocate owners");
+
+  for (size_t i = 0; i < n; i++) {
+    depth = 0;
+    obj_t *root = vals[i];
+    for (;;) {
+      if (root != NULL) {
+        page_t *pg = page_of(root);
+        size_t j = slot_of(pg, root);
+        uint32_t **po = &owners[page_index(pg)];
+        if (*po == NULL && (*po = calloc(pg->nslots, sizeof(uint32_t))) == NULL)
+          error("Failed to allocate owners");
+        uint32_t *o = &(*po)[j];
+        if (!test_bit(pg->mark, j) && *o != i + 1 && *o != OWNER_SHARED) {
+          *o = *o == 0 ? i + 1 : OWNER_SHARED;
+          if (depth + 4 > cap) {
+            cap = cap ? cap * 2 : 1024;
+            if ((stack = realloc(stack, cap * sizeof(obj_t *))) == NULL)
+              error("Failed to allocate mark stack");
+          }
+          switch (pg->type) {
+          case T_CELL:
+          case T_PROMISE:
+            stack[depth++] = root->car;
+            stack[depth++] = root->cdr;
+            break;
+          case T_FUNCTION:
+          case T_MACRO:
+            stack[depth++] = root->args;
+            stack[depth++] = root->body;
+            stack[depth++] = root->captured;
+            stack[depth++] = root->sym;
+            break;
+          default:
+            break;
+          }
+        }
+      }
+      if (depth == 0)
+        break;
+      root = stack[--depth];
+    }
+  }
+
+  for (size_t i = 0; i < n; i++)
+    bytes[i] = 0;
+  for (size_t i = 0; i < npages; i++) {
+    page_t *pg = all_pages[i];
+    for (size_t j = 0; owners[i] && j < pg->nslots; j++) {
+      uint32_t o = owners[i][j];
+      if (o != 0 && o != OWNER_SHARED)
+        bytes[o - 1] += object_bytes(pg, (obj_t *)(SLOTS(pg) + (j << pg->shift)));
+    }
+    free(owners[i]);
+    memset(pg->mark, 0, sizeof(pg->mark));
+  }
+
+  free(stack);
+  free(owners);
+}
+
+/* finalize every object and unmap the heap, leaving the collector as at startup */
+void gc_free_all()
+{
+  for (size_t i = 0; i < npages; i++) {
+    page_t *pg = all_pages[i];
+    memset(pg->mark, 0, sizeof(pg->mark));
+    sweep_page(pg);
+    free(pg->sites);
+    munmap(pg, MEMORY_SIZE);
+  }
+
+  free(all_pages);
+  all_pages = NULL;
+  npages = 0;
+  memset(pages, 0, sizeof(pages));
+  memset(alloc_page, 0, sizeof(alloc_page));
+  phase = GC_IDLE;
+  ngray = 0;
+  nroots = 0;
+  allocs_since_gc = 0;
+  live_slots = 0;
+  stack_top = NULL;
+  configured = 0;
+}
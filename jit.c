@@ -0,0 +1,486 @@
+#include "mlisp.h"
+#include <stdarg.h>
+#include <sys/mman.h>
+
+/*
+ * Template JIT for hot user functions.
+ *
+ * Once a function has been called MLISP_JIT_THRESHOLD times, apply() asks
+ * jit_call() to compile its body into x86-64 code working on unboxed
+ * ints. Only integer literals, parameters, + - *, binary comparisons in
+ * `if` conditions, `if`, `progn` and calls to the function itself are
+ * supported; anything else leaves the function to the interpreter.
+ *
+ * Global symbols in the body are resolved when the function is compiled.
+ * Before entering native code every one of them is looked up again, so
+ * redefining a primitive (or the function) sends the call back to the
+ * interpreter. MLISP_NO_JIT turns the JIT off.
+ */
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_DEFAULT_THRESHOLD 50
+#define JIT_MAX_PARAMS 6
+#define JIT_MAX_GUARDS 16
+
+typedef enum {
+  JIT_NONE,
+  JIT_COMPILED,
+  JIT_FAILED
+} jit_state_t;
+
+typedef int jit_code_t(int, int, int, int, int, int);
+
+typedef struct jit_guard_t {
+  char *name;
+  obj_t *value;
+} jit_guard_t;
+
+typedef struct jit_fn {
+  jit_state_t state;
+  int calls;
+  int nparams;
+  jit_code_t *code;
+  int nguards;
+  jit_guard_t guards[JIT_MAX_GUARDS];
+} jit_fn;
+
+int jit_compiled;
+
+#if defined(__x86_64__)
+
+static unsigned char *code_base;
+static size_t code_used;
+static int threshold = -1;      /* 0 when the JIT is off */
+
+/* state of one compilation */
+typedef struct jit_ctx_t {
+  obj_t **env;
+  obj_t *fn;
+  jit_fn *info;
+  unsigned char *start;
+  size_t len;
+  size_t cap;
+  int pushed;                   /* operands on the stack, for its alignment */
+  char *params[JIT_MAX_PARAMS];
+} jit_ctx_t;
+
+static int emit(jit_ctx_t *c, int n, ...)
+{
+  if (c->len + n > c->cap)
+    return 0;
+
+  va_list ap;
+  va_start(ap, n);
+  for (int i = 0; i < n; i++)
+    c->start[c->len++] = (unsigned char)va_arg(ap, int);
+  va_end(ap);
+  return 1;
+}
+
+static int emit32(jit_ctx_t *c, int v)
+{
+  return emit(c, 4, v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff);
+}
+
+static void patch32(jit_ctx_t *c, size_t at, int v)
+{
+  memcpy(c->start + at, &v, 4);
+}
+
+/* jump to the end of the code emitted so far from a rel32 at `at` */
+static void patch_here(jit_ctx_t *c, size_t at)
+{
+  patch32(c, at, (int)(c->len - (at + 4)));
+}
+
+static int param_index(jit_ctx_t *c, char *name)
+{
+  for (int i = 0; i < c->info->nparams; i++) {
+    if (strcmp(c->params[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* resolve a global symbol used by the body and remember it as a guard */
+static obj_t *resolve(jit_ctx_t *c, char *name)
+{
+  if (param_index(c, name) >= 0 || find_variable(c->fn->captured, name))
+    return NULL;
+
+  obj_t *val = find_variable(*global_env, name);
+  if (val == NULL)
+    return NULL;
+
+  jit_fn *info = c->info;
+  for (int i = 0; i < info->nguards; i++) {
+    if (strcmp(info->guards[i].name, name) == 0)
+      return val;
+  }
+
+  if (info->nguards == JIT_MAX_GUARDS)
+    return NULL;
+  info->guards[info->nguards++] = (jit_guard_t) { name, val };
+  return val;
+}
+
+static int compile_expr(jit_ctx_t *c, obj_t *obj);
+
+/* fold the values of args into eax with `op` */
+static int compile_fold(jit_ctx_t *c, obj_t *args, int op)
+{
+  if (!compile_expr(c, args->car))
+    return 0;
+
+  for (args = args->cdr; type_of(args) == T_CELL; args = args->cdr) {
+    c->pushed++;
+    if (!emit(c, 1, 0x50) ||                    /* push rax */
+        !compile_expr(c, args->car) ||
+        !emit(c, 3, 0x89, 0xc1, 0x58))          /* mov ecx, eax; pop rax */
+      return 0;
+    c->pushed--;
+
+    switch (op) {
+    case '+':
+      if (!emit(c, 2, 0x01, 0xc8))              /* add eax, ecx */
+        return 0;
+      break;
+    case '-':
+      if (!emit(c, 2, 0x29, 0xc8))              /* sub eax, ecx */
+        return 0;
+      break;
+    case '*':
+      if (!emit(c, 3, 0x0f, 0xaf, 0xc1))        /* imul eax, ecx */
+        return 0;
+      break;
+    }
+  }
+  return 1;
+}
+
+/* the jcc opcode (second byte) taken when the comparison is false */
+static int false_jump(primitive_t *fn)
+{
+  if (fn == prim_lt)
+    return 0x8d;                /* jge */
+  if (fn == prim_lte)
+    return 0x8f;                /* jg */
+  if (fn == prim_gt)
+    return 0x8e;                /* jle */
+  if (fn == prim_gte)
+    return 0x8c;                /* jl */
+  if (fn == prim_equal)
+    return 0x85;                /* jne */
+  return 0;
+}
+
+/*
+ * Compile the condition of an `if`, jumping to the rel32 stored in
+ * *false_at when it is nil. *false_at is 0 if the condition can't be false.
+ */
+static int compile_cond(jit_ctx_t *c, obj_t *obj, size_t *false_at)
+{
+  *false_at = 0;
+
+  if (type_of(obj) == T_TRUE)
+    return 1;
+
+  if (type_of(obj) == T_NIL) {
+    if (!emit(c, 1, 0xe9))                      /* jmp rel32 */
+      return 0;
+    *false_at = c->len;
+    return emit32(c, 0);
+  }
+
+  if (type_of(obj) == T_CELL && type_of(obj->car) == T_SYMBOL) {
+    obj_t *fn = resolve(c, obj->car->name);
+    int jcc = fn && type_of(fn) == T_PRIMITIVE ? false_jump(fn->fn) : 0;
+
+    if (jcc) {
+      obj_t *args = obj->cdr;
+      if (length(args) != 2)
+        return 0;
+
+      if (!compile_expr(c, args->car) ||
+          !emit(c, 1, 0x50))                    /* push rax */
+        return 0;
+      c->pushed++;
+      if (!compile_expr(c, args->cdr->car) ||
+          !emit(c, 5, 0x89, 0xc1, 0x58,         /* mov ecx, eax; pop rax */
+                0x39, 0xc8) ||                  /* cmp eax, ecx */
+          !emit(c, 2, 0x0f, jcc))
+        return 0;
+      c->pushed--;
+      *false_at = c->len;
+      return emit32(c, 0);
+    }
+  }
+
+  /* any int value is true */
+  return compile_expr(c, obj);
+}
+
+static int compile_if(jit_ctx_t *c, obj_t *args)
+{
+  size_t false_at, end_at;
+
+  if (length(args) != 3 || !compile_cond(c, args->car, &false_at))
+    return 0;
+
+  if (!compile_expr(c, args->cdr->car) ||
+      !emit(c, 1, 0xe9))                        /* jmp rel32 */
+    return 0;
+  end_at = c->len;
+  if (!emit32(c, 0))
+    return 0;
+
+  if (false_at)
+    patch_here(c, false_at);
+  if (!compile_expr(c, args->cdr->cdr->car))
+    return 0;
+  patch_here(c, end_at);
+  return 1;
+}
+
+static int compile_self_call(jit_ctx_t *c, obj_t *args)
+{
+  /* pop rdi, rsi, rdx, rcx, r8, r9: the register of parameter i */
+  static const unsigned char pops[][2] = {
+    { 0x5f }, { 0x5e }, { 0x5a }, { 0x59 }, { 0x41, 0x58 }, { 0x41, 0x59 }
+  };
+  int n = c->info->nparams;
+
+  if (length(args) != n)
+    return 0;
+
+  for (; type_of(args) == T_CELL; args = args->cdr) {
+    if (!compile_expr(c, args->car) || !emit(c, 1, 0x50))  /* push rax */
+      return 0;
+    c->pushed++;
+  }
+
+  for (int i = n - 1; i >= 0; i--) {
+    if (!(pops[i][0] == 0x41 ? emit(c, 2, pops[i][0], pops[i][1]) : emit(c, 1, pops[i][0])))
+      return 0;
+  }
+  c->pushed -= n;
+
+  /* the callee may call into C: keep rsp 16-byte aligned with operands pushed */
+  int pad = c->pushed % 2;
+  if (pad && !emit(c, 4, 0x48, 0x83, 0xec, 0x08))  /* sub rsp, 8 */
+    return 0;
+  if (!emit(c, 1, 0xe8) ||                      /* call rel32 */
+      !emit32(c, -(int)(c->len + 4)))
+    return 0;
+  return !pad || emit(c, 4, 0x48, 0x83, 0xc4, 0x08);  /* add rsp, 8 */
+}
+
+static int compile_expr(jit_ctx_t *c, obj_t *obj)
+{
+  switch (type_of(obj)) {
+  case T_INT:
+    return emit(c, 1, 0xb8) && emit32(c, obj->value);  /* mov eax, imm32 */
+  case T_SYMBOL: {
+    int i = param_index(c, obj->name);
+    if (i < 0)
+      return 0;
+    return emit(c, 3, 0x8b, 0x45, -8 * (i + 1));        /* mov eax, [rbp-8(i+1)] */
+  }
+  case T_CELL:
+    break;
+  default:
+    return 0;
+  }
+
+  if (type_of(obj->car) != T_SYMBOL)
+    return 0;
+
+  obj_t *fn = resolve(c, obj->car->name);
+  obj_t *args = obj->cdr;
+  if (fn == c->fn)
+    return compile_self_call(c, args);
+
+  if (fn == NULL || type_of(fn) != T_PRIMITIVE)
+    return 0;
+
+  if (fn->fn == prim_plus) {
+    if (type_of(args) == T_NIL)
+      return emit(c, 1, 0xb8) && emit32(c, 0);
+    return compile_fold(c, args, '+');
+  } else if (fn->fn == prim_mul) {
+    if (type_of(args) == T_NIL)
+      return emit(c, 1, 0xb8) && emit32(c, 1);
+    return compile_fold(c, args, '*');
+  } else if (fn->fn == prim_minus) {
+    /* (- a) is a in mlisp */
+    return type_of(args) == T_CELL && compile_fold(c, args, '-');
+  } else if (fn->fn == prim_if) {
+    return compile_if(c, args);
+  } else if (fn->fn == prim_progn) {
+    if (type_of(args) == T_NIL)
+      return 0;
+    for (; type_of(args) == T_CELL; args = args->cdr) {
+      if (!compile_expr(c, args->car))
+        return 0;
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+/* compiled self-calls don't go through eval(), so they check the stack and timeout here */
+static void stack_overflow()
+{
+  error("Stack overflow");
+}
+
+static void time_limit_exceeded()
+{
+  error("Time limit exceeded");
+}
+
+static int emit_ptr(jit_ctx_t *c, void *p)
+{
+  return emit32(c, (int)(uintptr_t)p) && emit32(c, (int)((uintptr_t)p >> 32));
+}
+
+static int compile(obj_t **env, obj_t *fn, jit_fn *info)
+{
+  /* mov [rbp-8(i+1)], edi / esi / edx / ecx / r8d / r9d */
+  static const unsigned char stores[][2] = {
+    { 0x00, 0x7d }, { 0x00, 0x75 }, { 0x00, 0x55 },
+    { 0x00, 0x4d }, { 0x44, 0x45 }, { 0x44, 0x4d }
+  };
+
+  if (code_base == NULL) {
+    code_base = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (code_base == MAP_FAILED) {
+      code_base = NULL;
+      return 0;
+    }
+  }
+
+  jit_ctx_t c = { env, fn, info, code_base + code_used, 0, JIT_CODE_SIZE - code_used };
+
+  info->nparams = 0;
+  for (obj_t *p = fn->args; type_of(p) == T_CELL; p = p->cdr) {
+    if (info->nparams == JIT_MAX_PARAMS || type_of(p->car) != T_SYMBOL ||
+        param_index(&c, p->car->name) >= 0)
+      return 0;
+    c.params[info->nparams++] = p->car->name;
+  }
+
+  if (mprotect(code_base, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0)
+    return 0;
+
+  int ok = emit(&c, 4, 0x55, 0x48, 0x89, 0xe5) &&         /* push rbp; mov rbp, rsp */
+    emit(&c, 3, 0x48, 0x81, 0xec) && emit32(&c, 8 * ((info->nparams + 1) & ~1)) &&
+    emit(&c, 2, 0x48, 0xb8) && emit_ptr(&c, &stack_limit) &&  /* mov rax, &stack_limit */
+    emit(&c, 5, 0x48, 0x3b, 0x20, 0x73, 12) &&              /* cmp rsp, [rax]; jae +12 */
+    emit(&c, 2, 0x48, 0xb8) && emit_ptr(&c, stack_overflow) &&  /* mov rax, stack_overflow */
+    emit(&c, 2, 0xff, 0xd0) &&                              /* call rax */
+    emit(&c, 2, 0x48, 0xb8) && emit_ptr(&c, (void *)&eval_timeout) &&  /* mov rax, &eval_timeout */
+    emit(&c, 5, 0x83, 0x38, 0x00, 0x74, 12) &&              /* cmp dword [rax], 0; je +12 */
+    emit(&c, 2, 0x48, 0xb8) && emit_ptr(&c, time_limit_exceeded) &&
+    emit(&c, 2, 0xff, 0xd0);                                /* call rax */
+  for (int i = 0; ok && i < info->nparams; i++) {
+    ok = stores[i][0] ? emit(&c, 1, stores[i][0]) : 1;
+    ok = ok && emit(&c, 3, 0x89, stores[i][1], -8 * (i + 1));
+  }
+
+  /* the body is a progn */
+  ok = ok && type_of(fn->body) == T_CELL;
+  for (obj_t *b = fn->body; ok && type_of(b) == T_CELL; b = b->cdr)
+    ok = compile_expr(&c, b->car);
+  ok = ok && emit(&c, 2, 0xc9, 0xc3);                      /* leave; ret */
+
+  mprotect(code_base, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+  if (!ok)
+    return 0;
+
+  info->code = (jit_code_t *)c.start;
+  code_used += (c.len + 15) & ~15;
+  jit_compiled++;
+  return 1;
+}
+
+/*
+ * Run fn natively on the evaluated args if it is (or just became)
+ * compiled. Returns NULL when the interpreter has to handle the call.
+ */
+obj_t *jit_call(obj_t **env, obj_t *fn, obj_t *vals)
+{
+  if (threshold < 0) {
+    char *val = getenv("MLISP_JIT_THRESHOLD");
+    threshold = (val && val[0]) ? atoi(val) : JIT_DEFAULT_THRESHOLD;
+    if (threshold < 1)
+      threshold = 1;
+    if (get_env_flag("MLISP_NO_JIT"))
+      threshold = 0;
+  }
+  if (threshold == 0)
+    return NULL;
+
+  jit_fn *info = fn->jit;
+  if (info == NULL) {
+    info = fn->jit = calloc(1, sizeof(jit_fn));
+    if (info == NULL)
+      return NULL;
+  }
+
+  if (info->state == JIT_FAILED)
+    return NULL;
+
+  if (info->state == JIT_NONE) {
+    if (++info->calls < threshold)
+      return NULL;
+    info->state = compile(env, fn, info) ? JIT_COMPILED : JIT_FAILED;
+    if (info->state == JIT_FAILED)
+      return NULL;
+  }
+
+  int args[JIT_MAX_PARAMS] = { 0 };
+  int n = 0;
+  for (; type_of(vals) == T_CELL; vals = vals->cdr) {
+    if (n == info->nparams || type_of(vals->car) != T_INT)
+      return NULL;
+    args[n++] = vals->car->value;
+  }
+  if (n != info->nparams)
+    return NULL;
+
+  for (int i = 0; i < info->nguards; i++) {
+    if (find_variable(*global_env, info->guards[i].name) != info->guards[i].value)
+      return NULL;
+  }
+
+  return new_int(env, info->code(args[0], args[1], args[2], args[3], args[4], args[5]));
+}
+
+/* reuse the code buffer, once no compiled function is left */
+void jit_reset()
+{
+  code_used = 0;
+}
+
+#else
+
+obj_t *jit_call(obj_t **env, obj_t *fn, obj_t *vals)
+{
+  return NULL;
+}
+
+void jit_reset()
+{
+}
+
+#endif
+
+/* keep the values the guards compare against alive, or their slots could be reused */
+void jit_mark(jit_fn *info)
+{
+  for (int i = 0; i < info->nguards; i++)
+    gc_mark_object(info->guards[i].value);
+}
@@ -0,0 +1,69 @@
+#ifndef LIBMLISP_H
+#define LIBMLISP_H
+
+#include <stddef.h>
+
+/*
+ * Embedding API, built into libmlisp.a and libmlisp.so.
+ *
+ * The interpreter keeps its state in globals: there is at most one
+ * interpreter per process at a time, and it must not be called from two
+ * threads at once. Definitions persist from one mlisp_eval() to the next.
+ *
+ * Values handed to the host stay valid until the next call into the
+ * interpreter, unless kept in a variable registered with mlisp_protect().
+ *
+ * The library exports nothing but the functions declared here: the
+ * interpreter is built with -fvisibility=hidden.
+ */
+
+#define MLISP_OK 0
+#define MLISP_ERROR -1
+
+#define MLISP_API __attribute__((visibility("default")))
+
+typedef struct mlisp_t mlisp_t;
+typedef struct obj_t obj_t;     /* opaque, see the functions below */
+typedef struct obj_t *primitive_t(struct obj_t **env, struct obj_t *args);
+
+MLISP_API mlisp_t *mlisp_create();
+MLISP_API void mlisp_destroy(mlisp_t *m);
+
+/*
+ * Evaluate the forms in src[0..len) in order and store the value of the
+ * last one in *result (nil for no form). Returns MLISP_ERROR, with the
+ * reason in mlisp_error(), if a form couldn't be parsed or evaluated.
+ */
+MLISP_API int mlisp_eval(mlisp_t *m, const char *src, size_t len, obj_t **result);
+MLISP_API const char *mlisp_error(mlisp_t *m);
+
+/* a primitive gets its arguments unevaluated, see mlisp_eval_arg() */
+MLISP_API int mlisp_define_primitive(mlisp_t *m, const char *name, primitive_t *fn);
+MLISP_API void mlisp_protect(mlisp_t *m, obj_t **var);
+MLISP_API void mlisp_unprotect(mlisp_t *m, obj_t **var);
+
+/* inspecting values */
+MLISP_API int mlisp_is_nil(obj_t *obj);
+MLISP_API int mlisp_is_int(obj_t *obj);
+MLISP_API int mlisp_is_symbol(obj_t *obj);
+MLISP_API int mlisp_is_string(obj_t *obj);
+MLISP_API int mlisp_is_cell(obj_t *obj);
+MLISP_API int mlisp_int_value(obj_t *obj);
+MLISP_API const char *mlisp_symbol_name(obj_t *obj);
+MLISP_API const char *mlisp_string_value(obj_t *obj);
+MLISP_API obj_t *mlisp_car(obj_t *obj);
+MLISP_API obj_t *mlisp_cdr(obj_t *obj);
+MLISP_API int mlisp_length(obj_t *obj);
+MLISP_API char *mlisp_print(obj_t *obj);  /* to be freed by the caller */
+
+/* for host primitives */
+MLISP_API obj_t *mlisp_eval_arg(obj_t **env, obj_t *arg);
+MLISP_API obj_t *mlisp_nil();
+MLISP_API obj_t *mlisp_true();
+MLISP_API obj_t *mlisp_make_int(obj_t **env, int v);
+MLISP_API obj_t *mlisp_make_string(obj_t **env, const char *str);
+MLISP_API obj_t *mlisp_make_symbol(obj_t **env, const char *name);
+MLISP_API obj_t *mlisp_cons(obj_t **env, obj_t *car, obj_t *cdr);
+MLISP_API void mlisp_raise(const char *msg);  /* fails the current mlisp_eval() */
+
+#endif  /* LIBMLISP_H */
@@ -0,0 +1,680 @@
+#include "mlisp.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * (load "file") evaluates the forms of a source file, in order, in the
+ * global environment.
+ *
+ * Each top-level form has its macros expanded before it is evaluated,
+ * and once the whole file has been loaded the expanded forms are written
+ * to "file.mlc". Later loads evaluate the forms from there, skipping
+ * parse(), allocation() and macro expansion. The cache is used when the
+ * source has the recorded size and either the recorded mtime or the
+ * recorded content hash. A source modified within a second of writing its
+ * cache is always checked by hash, since its mtime can't tell edits apart.
+ *
+ * The expansions also depend on the macros used, which may come from
+ * other files. A form is preceded by the name and a hash of the
+ * definition of each macro its expansion called, checked against the
+ * current definitions right before the form is evaluated. When one has
+ * changed, the cache is removed and the rest of the file is loaded from
+ * the source.
+ *
+ * Cache layout, integers in host byte order:
+ *
+ *   "MLC2" size mtime hash body_size body_hash   header
+ *   nsyms { len name }                           symbol table
+ *   { ['D' u32 n { u32 symbol u64 hash }] form } body, ends with 'E'
+ *
+ * A value is a tag byte followed by its payload: 'N' nil, 'T' t,
+ * 'I' int32, 'S' u32 symbol index, 'Q' u32 length and bytes of a string,
+ * 'L' u32 count, that many values and the tail of the list.
+ */
+
+#define CACHE_MAGIC "MLC2"
+#define CACHE_SUFFIX ".mlc"
+
+typedef struct cache_header_t {
+  char magic[4];
+  uint64_t size;
+  int64_t mtime;
+  uint64_t hash;
+  uint64_t body_size;
+  uint64_t body_hash;
+} cache_header_t;
+
+typedef struct bytes_t {
+  char *data;
+  size_t len;
+  size_t cap;
+} bytes_t;
+
+/* symbols of the forms being written, indexed in order of appearance */
+typedef struct symtab_t {
+  char **names;
+  size_t len;
+  size_t *slots;                /* open addressing, index + 1 */
+  size_t nslots;
+} symtab_t;
+
+/* the macros a form's expansion called */
+typedef struct deps_t {
+  char **names;
+  uint64_t *hashes;             /* of their definitions */
+  size_t len;
+  size_t cap;
+} deps_t;
+
+typedef struct reader_t {
+  char *p;
+  char *end;
+  obj_t **syms;
+  size_t nsyms;
+} reader_t;
+
+size_t stat_loads;
+size_t stat_load_cached;
+
+static uint64_t fnv(const char *p, size_t len)
+{
+  uint64_t h = 14695981039346656037UL;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)p[i]) * 1099511628211UL;
+  return h;
+}
+
+/* recurse on car, loop on cdr */
+static uint64_t hash_obj(uint64_t h, obj_t *obj)
+{
+  for (;; obj = obj->cdr) {
+    h = (h ^ type_of(obj)) * 1099511628211UL;
+    switch (type_of(obj)) {
+    case T_INT:
+      return (h ^ (uint32_t)obj->value) * 1099511628211UL;
+    case T_SYMBOL:
+    case T_STRING:
+      for (char *p = obj->name; *p; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211UL;
+      return h;
+    case T_CELL:
+      h = hash_obj(h, obj->car);
+      break;
+    case T_NIL:
+    case T_TRUE:
+      return h;
+    default:
+      return (h ^ (uintptr_t)obj) * 1099511628211UL;
+    }
+  }
+}
+
+static uint64_t macro_hash(obj_t *macro)
+{
+  return hash_obj(hash_obj(14695981039346656037UL, macro->args), macro->body);
+}
+
+/* note that the expansion of obj called the macro it names */
+static void depend(deps_t *deps, obj_t **env, obj_t *obj)
+{
+  for (size_t i = 0; i < deps->len; i++) {
+    if (strcmp(deps->names[i], obj->car->name) == 0)
+      return;
+  }
+
+  if (deps->len == deps->cap) {
+    deps->cap = deps->cap ? deps->cap * 2 : 8;
+    deps->names = realloc(deps->names, deps->cap * sizeof(char *));
+    deps->hashes = realloc(deps->hashes, deps->cap * sizeof(uint64_t));
+    if (deps->names == NULL || deps->hashes == NULL)
+      error("Failed to allocate load cache");
+  }
+  deps->names[deps->len] = obj->car->name;
+  deps->hashes[deps->len++] = macro_hash(lookup(env, obj->car->name));
+}
+
+static void put(bytes_t *b, const void *p, size_t n)
+{
+  if (b->len + n > b->cap) {
+    while (b->len + n > b->cap)
+      b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = realloc(b->data, b->cap);
+    if (b->data == NULL)
+      error("Failed to allocate load cache");
+  }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+static void put_u32(bytes_t *b, uint32_t v)
+{
+  put(b, &v, sizeof(v));
+}
+
+static void put_tag(bytes_t *b, char tag)
+{
+  put(b, &tag, 1);
+}
+
+static uint32_t symbol_index(symtab_t *tab, char *name)
+{
+  if (tab->len * 2 >= tab->nslots) {
+    size_t n = tab->nslots ? tab->nslots * 2 : 64;
+    size_t *slots = calloc(n, sizeof(size_t));
+    if (slots == NULL)
+      error("Failed to allocate load cache");
+    for (size_t i = 0; i < tab->len; i++) {
+      size_t h = fnv(tab->names[i], strlen(tab->names[i])) & (n - 1);
+      while (slots[h])
+        h = (h + 1) & (n - 1);
+      slots[h] = i + 1;
+    }
+    free(tab->slots);
+    tab->slots = slots;
+    tab->nslots = n;
+    tab->names = realloc(tab->names, n / 2 * sizeof(char *));
+    if (tab->names == NULL)
+      error("Failed to allocate load cache");
+  }
+
+  size_t h = fnv(name, strlen(name)) & (tab->nslots - 1);
+  for (; tab->slots[h]; h = (h + 1) & (tab->nslots - 1)) {
+    if (strcmp(tab->names[tab->slots[h] - 1], name) == 0)
+      return tab->slots[h] - 1;
+  }
+  tab->names[tab->len] = name;
+  tab->slots[h] = ++tab->len;
+  return tab->len - 1;
+}
+
+/* recurse on car, loop on cdr */
+static void encode(bytes_t *b, symtab_t *tab, obj_t *obj)
+{
+  switch (type_of(obj)) {
+  case T_NIL:
+    put_tag(b, 'N');
+    break;
+  case T_TRUE:
+    put_tag(b, 'T');
+    break;
+  case T_INT:
+    put_tag(b, 'I');
+    put(b, &obj->value, sizeof(int32_t));
+    break;
+  case T_SYMBOL:
+    put_tag(b, 'S');
+    put_u32(b, symbol_index(tab, obj->name));
+    break;
+  case T_STRING:
+    put_tag(b, 'Q');
+    put_u32(b, strlen(obj->name));
+    put(b, obj->name, strlen(obj->name));
+    break;
+  case T_CELL: {
+    put_tag(b, 'L');
+    size_t at = b->len;
+    uint32_t n = 0;
+    put_u32(b, 0);
+    for (; type_of(obj) == T_CELL; obj = obj->cdr, n++)
+      encode(b, tab, obj->car);
+    memcpy(b->data + at, &n, sizeof(n));
+    encode(b, tab, obj);
+    break;
+  }
+  default:
+    /* a macro expanded to a function or primitive object */
+    error("load: Form can't be cached");
+  }
+}
+
+static int get(reader_t *r, void *p, size_t n)
+{
+  if ((size_t)(r->end - r->p) < n)
+    return 0;
+  memcpy(p, r->p, n);
+  r->p += n;
+  return 1;
+}
+
+/* NULL if the data is malformed */
+static obj_t *decode(obj_t **env, reader_t *r)
+{
+  char tag;
+  uint32_t u;
+  int32_t i;
+
+  if (!get(r, &tag, 1))
+    return NULL;
+
+  switch (tag) {
+  case 'N':
+    return NIL;
+  case 'T':
+    return TRUE;
+  case 'I':
+    return get(r, &i, sizeof(i)) ? new_int(env, i) : NULL;
+  case 'S':
+    return get(r, &u, sizeof(u)) && u < r->nsyms ? r->syms[u] : NULL;
+  case 'Q': {
+    if (!get(r, &u, sizeof(u)) || (size_t)(r->end - r->p) < u)
+      return NULL;
+    char *str = strndup(r->p, u);
+    r->p += u;
+    return new_string(env, str);
+  }
+  case 'L': {
+    if (!get(r, &u, sizeof(u)) || u == 0)
+      return NULL;
+    obj_t *head = NULL, *tail = NULL;
+    for (; u > 0; u--) {
+      obj_t *v = decode(env, r);
+      if (v == NULL)
+        return NULL;
+      obj_t *cell = new_cell(env, v, NIL);
+      if (head == NULL)
+        head = cell;
+      else
+        tail->cdr = cell;
+      gc_write_barrier(tail ? tail : cell, cell);
+      tail = cell;
+    }
+    obj_t *rest = decode(env, r);
+    if (rest == NULL)
+      return NULL;
+    tail->cdr = rest;
+    gc_write_barrier(tail, rest);
+    return head;
+  }
+  default:
+    return NULL;
+  }
+}
+
+/* the primitive a form's head names, if any */
+static primitive_t *special_form(obj_t **env, obj_t *obj)
+{
+  if (type_of(obj->car) != T_SYMBOL)
+    return NULL;
+  obj_t *fn = lookup(env, obj->car->name);
+  return fn != NULL && type_of(fn) == T_PRIMITIVE ? fn->fn : NULL;
+}
+
+static obj_t *expand_all(obj_t **env, obj_t *obj, deps_t *deps);
+
+/* expand the elements of lst from the skip-th on, copying the spine */
+static obj_t *expand_list(obj_t **env, obj_t *lst, int skip, deps_t *deps)
+{
+  obj_t *head = NIL, *tail = NIL;
+  for (int i = 0; type_of(lst) == T_CELL; lst = lst->cdr, i++) {
+    obj_t *v = i < skip ? lst->car : expand_all(env, lst->car, deps);
+    obj_t *cell = new_cell(env, v, NIL);
+    if (head == NIL)
+      head = cell;
+    else
+      tail->cdr = cell;
+    gc_write_barrier(tail == NIL ? cell : tail, cell);
+    tail = cell;
+  }
+
+  if (head == NIL)
+    return lst;
+  tail->cdr = lst;
+  gc_write_barrier(tail, lst);
+  return head;
+}
+
+/* expand every macro call in obj, leaving quoted data and parameter lists alone */
+static obj_t *expand_all(obj_t **env, obj_t *obj, deps_t *deps)
+{
+  obj_t *expanded;
+  while (type_of(obj) == T_CELL && (expanded = macroexpand(env, obj)) != obj) {
+    depend(deps, env, obj);
+    obj = expanded;
+  }
+  if (type_of(obj) != T_CELL)
+    return obj;
+
+  primitive_t *fn = special_form(env, obj);
+  if (fn == prim_quote)
+    return obj;
+  if (fn == prim_lambda)
+    return expand_list(env, obj, 2, deps);
+  if (fn == prim_defun || fn == prim_defun_memo || fn == prim_defmacro)
+    return expand_list(env, obj, 3, deps);
+
+  if ((fn == prim_let || fn == prim_dotimes || fn == prim_dolist) && type_of(obj->cdr) == T_CELL) {
+    /* (let ((a init)...) body...) (dotimes (i count result) body...) */
+    obj_t *spec = obj->cdr->car;
+    if (fn == prim_let) {
+      obj_t *bindings = NIL, *last = NIL;
+      for (; type_of(spec) == T_CELL; spec = spec->cdr) {
+        obj_t *b = spec->car;
+        if (type_of(b) == T_CELL)
+          b = expand_list(env, b, 1, deps);
+        obj_t *cell = new_cell(env, b, NIL);
+        if (bindings == NIL)
+          bindings = cell;
+        else
+          last->cdr = cell;
+        gc_write_barrier(last == NIL ? cell : last, cell);
+        last = cell;
+      }
+      spec = bindings;
+    } else if (type_of(spec) == T_CELL) {
+      spec = expand_list(env, spec, 1, deps);
+    }
+    obj_t *rest = expand_list(env, obj->cdr->cdr, 0, deps);
+    return new_cell(env, obj->car, new_cell(env, spec, rest));
+  }
+
+  return expand_list(env, obj, 0, deps);
+}
+
+static char *cache_path(char *path)
+{
+  char *cpath = malloc(strlen(path) + strlen(CACHE_SUFFIX) + 1);
+  if (cpath == NULL)
+    error("Failed to allocate load cache");
+  strcpy(cpath, path);
+  strcat(cpath, CACHE_SUFFIX);
+  return cpath;
+}
+
+static char *read_file(char *path, size_t *len)
+{
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL)
+    return NULL;
+
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *data = malloc(size > 0 ? size : 1);
+  if (data == NULL || (size > 0 && fread(data, 1, size, fp) != (size_t)size)) {
+    free(data);
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+  *len = size;
+  return data;
+}
+
+/* whether the macros of a 'D' record are defined as they were */
+static int deps_current(reader_t *r)
+{
+  char tag;
+  uint32_t n, sym;
+  uint64_t hash;
+  get(r, &tag, 1);
+  if (!get(r, &n, sizeof(n)))
+    error("load: Broken cache");
+
+  int current = 1;
+  for (; n > 0; n--) {
+    if (!get(r, &sym, sizeof(sym)) || !get(r, &hash, sizeof(hash)) || sym >= r->nsyms)
+      error("load: Broken cache");
+    obj_t *macro = lookup(global_env, r->syms[sym]->name);
+    if (macro == NULL || type_of(macro) != T_MACRO || macro_hash(macro) != hash)
+      current = 0;
+  }
+  return current;
+}
+
+/*
+ * Evaluate the forms of a valid cache. Returns 0 if the cache doesn't
+ * match the source, with the number of forms evaluated before that was
+ * found out in *done.
+ */
+static int load_cache(char *path, char *cpath, struct stat *st, char **source, size_t *source_len,
+                      int *done)
+{
+  size_t len;
+  char *data = read_file(cpath, &len);
+  if (data == NULL)
+    return 0;
+
+  cache_header_t h;
+  reader_t r = { data + sizeof(h), data + len, NULL, 0 };
+  if (len < sizeof(h))
+    goto invalid;
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, CACHE_MAGIC, 4) != 0 || h.size != (uint64_t)st->st_size)
+    goto invalid;
+  if (h.body_size != len - sizeof(h) || h.body_hash != fnv(r.p, h.body_size))
+    goto invalid;
+
+  if (h.mtime != (int64_t)st->st_mtime) {
+    /* touched but maybe not changed */
+    if (*source == NULL && (*source = read_file(path, source_len)) == NULL)
+      goto invalid;
+    if (h.hash != fnv(*source, *source_len))
+      goto invalid;
+  }
+
+  uint32_t nsyms;
+  if (!get(&r, &nsyms, sizeof(nsyms)))
+    goto invalid;
+  r.syms = malloc((nsyms ? nsyms : 1) * sizeof(obj_t *));
+  if (r.syms == NULL)
+    goto invalid;
+  for (r.nsyms = 0; r.nsyms < nsyms; r.nsyms++) {
+    uint32_t n;
+    if (!get(&r, &n, sizeof(n)) || (size_t)(r.end - r.p) < n)
+      goto invalid;
+    char *name = strndup(r.p, n);
+    r.p += n;
+    r.syms[r.nsyms] = intern(global_env, name);
+    free(name);
+  }
+
+  /* the body hash matched, so the forms decode */
+  while (r.p < r.end && *r.p != 'E') {
+    if (*r.p == 'D') {
+      if (!deps_current(&r))
+        goto invalid;
+      continue;
+    }
+    obj_t *form = decode(global_env, &r);
+    if (form == NULL)
+      error("load: Broken cache");
+    eval(global_env, form);
+    (*done)++;
+  }
+
+  free(r.syms);
+  free(data);
+  return 1;
+
+invalid:
+  free(r.syms);
+  free(data);
+  return 0;
+}
+
+static void write_cache(char *cpath, struct stat *st, char *source, size_t source_len,
+                        bytes_t *body, symtab_t *tab)
+{
+  bytes_t out = { NULL, 0, 0 };
+  cache_header_t h = { CACHE_MAGIC, st->st_size, st->st_mtime, fnv(source, source_len), 0, 0 };
+  /* the source may still change within the same second, check its hash */
+  if (st->st_mtime >= time(NULL) - 1)
+    h.mtime = -1;
+  put(&out, &h, sizeof(h));
+  put_u32(&out, tab->len);
+  for (size_t i = 0; i < tab->len; i++) {
+    put_u32(&out, strlen(tab->names[i]));
+    put(&out, tab->names[i], strlen(tab->names[i]));
+  }
+  put(&out, body->data, body->len);
+  put_tag(&out, 'E');
+
+  cache_header_t *hp = (cache_header_t *)out.data;
+  hp->body_size = out.len - sizeof(h);
+  hp->body_hash = fnv(out.data + sizeof(h), hp->body_size);
+
+  /* write and rename so that a concurrent load never sees half a file */
+  char *tmp = malloc(strlen(cpath) + 16);
+  sprintf(tmp, "%s.%d", cpath, (int)getpid());
+  FILE *fp = fopen(tmp, "wb");
+  if (fp != NULL) {
+    int ok = fwrite(out.data, 1, out.len, fp) == out.len;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp, cpath) != 0)
+      remove(tmp);
+  }
+  free(tmp);
+  free(out.data);
+}
+
+/*
+ * Parse, expand and evaluate the forms of the source from the skip-th
+ * on, then cache them if it evaluated them all.
+ */
+static void load_source(char *cpath, struct stat *st, char *source, size_t len, int skip)
+{
+  FILE *fp = fmemopen(source, len, "r");
+  if (fp == NULL)
+    error("load: Failed to read file");
+
+  bytes_t body = { NULL, 0, 0 };
+  symtab_t tab = { NULL, 0, NULL, 0 };
+  deps_t deps = { NULL, NULL, 0, 0 };
+  FILE *prev = set_parse_input(fp);
+  jmp_buf jb, *prev_handler = error_handler;
+
+  /* put the reader back before passing errors on */
+  error_handler = &jb;
+  if (setjmp(jb) != 0) {
+    error_handler = prev_handler;
+    set_parse_input(prev);
+    fclose(fp);
+    free(body.data);
+    free(tab.names);
+    free(tab.slots);
+    free(deps.names);
+    free(deps.hashes);
+    error(error_message);
+  }
+
+  node_t *node;
+  int cacheable = skip == 0;
+  for (; skip > 0 && (node = parse()) != NULL; skip--)
+    destory_ast(node);
+  while ((node = parse()) != NULL) {
+    obj_t *form = allocation(global_env, node);
+    destory_ast(node);
+    deps.len = 0;
+    form = expand_all(global_env, form, &deps);
+    if (cacheable) {
+      jmp_buf cjb;
+      error_handler = &cjb;
+      if (setjmp(cjb) == 0) {
+        if (deps.len > 0) {
+          put_tag(&body, 'D');
+          put_u32(&body, deps.len);
+          for (size_t i = 0; i < deps.len; i++) {
+            put_u32(&body, symbol_index(&tab, deps.names[i]));
+            put(&body, &deps.hashes[i], sizeof(uint64_t));
+          }
+        }
+        encode(&body, &tab, form);
+      } else {
+        cacheable = 0;
+      }
+      error_handler = &jb;
+    }
+    eval(global_env, form);
+  }
+
+  error_handler = prev_handler;
+  set_parse_input(prev);
+  fclose(fp);
+
+  /* a stale cache would only be found stale again */
+  if (cacheable)
+    write_cache(cpath, st, source, len, &body, &tab);
+  else
+    remove(cpath);
+  free(body.data);
+  free(tab.names);
+  free(tab.slots);
+  free(deps.names);
+  free(deps.hashes);
+}
+
+/* load a file as (load "path") does */
+void load_file(char *path)
+{
+  struct stat st;
+  if (stat(path, &st) != 0)
+    error("load: No such file");
+
+  stat_loads++;
+  char *cpath = cache_path(path);
+  char *source = NULL;
+  size_t len = 0;
+  int done = 0;
+
+  if (!get_env_flag("MLISP_NO_LOAD_CACHE") && load_cache(path, cpath, &st, &source, &len, &done)) {
+    stat_load_cached++;
+  } else {
+    if (source == NULL && (source = read_file(path, &len)) == NULL) {
+      free(cpath);
+      error("load: Failed to read file");
+    }
+    load_source(cpath, &st, source, len, done);
+  }
+
+  free(source);
+  free(cpath);
+}
+
+obj_t *prim_load(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("load: Wrong number of arguments");
+
+  obj_t *path = eval(env, args->car);
+  if (type_of(path) != T_STRING)
+    error("load: File name should be a string");
+
+  load_file(path->name);
+  return TRUE;
+}
+
+/* evaluate the forms in src[0..len), returns the value of the last one */
+obj_t *eval_string(obj_t **env, const char *src, size_t len)
+{
+  if (len == 0)
+    return NIL;
+
+  FILE *fp = fmemopen((void *)src, len, "r");
+  if (fp == NULL)
+    error("Failed to read source");
+
+  /* put the reader back before passing errors on */
+  FILE *prev = set_parse_input(fp);
+  jmp_buf jb, *prev_handler = error_handler;
+  error_handler = &jb;
+  if (setjmp(jb) != 0) {
+    error_handler = prev_handler;
+    set_parse_input(prev);
+    fclose(fp);
+    error(error_message);
+  }
+
+  node_t *node;
+  obj_t *ret = NIL;
+  while ((node = parse()) != NULL) {
+    obj_t *form = allocation(env, node);
+    destory_ast(node);
+    ret = eval(env, form);
+  }
+
+  error_handler = prev_handler;
+  set_parse_input(prev);
+  fclose(fp);
+  return ret;
+}
@@ -0,0 +1,70 @@
+#include "mlisp.h"
+#include <sys/resource.h>
+#include <unistd.h>
+
+void print_stats()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(stderr, "allocs=%zu bytes=%zu gcs=%zu gc_max_pause_us=%ld gc_total_us=%ld heap_kb=%zu jit=%d loads=%zu load_cached=%zu maxrss_kb=%ld\n",
+          stat_allocs, stat_bytes, stat_gcs, stat_gc_max_pause_us,
+          stat_gc_total_us, gc_heap_size() / 1024, jit_compiled,
+          stat_loads, stat_load_cached, ru.ru_maxrss);
+}
+
+int main(int argc, char *argv[])
+{
+  char *socket_path = NULL;
+  char *preloads[argc];
+  int npreloads = 0, workers = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:c:s:l:w:")) != -1) {
+    switch (opt) {
+    case 'b':
+      return run_batch(optarg);
+    case 'c':
+      return run_client(optarg);
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'l':
+      preloads[npreloads++] = optarg;
+      break;
+    case 'w':
+      workers = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-b cases | -c socket | -s socket [-l file]... [-w workers]]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (socket_path)
+    return run_server(socket_path, workers, preloads, npreloads);
+
+  node_t *node = parse();
+
+  if (get_env_flag("MLISP_PARSE_TEST")) {
+    print_node(node);
+    return 0;
+  }
+
+  obj_t *env;
+  initialize(&env);
+  obj_t *obj = allocation(&env, node);
+  destory_ast(node);
+  obj_t *ret = eval(&env, obj);
+
+  if (get_env_flag("MLISP_STATS"))
+    print_stats();
+  if (heap_profiling)
+    heap_dump(stderr);
+
+  if (get_env_flag("MLISP_EVAL_TEST")) {
+    print_obj(ret);
+    return 0;
+  }
+
+  print_obj(ret);
+  return 0;
+}
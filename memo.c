@@ -0,0 +1,265 @@
+#include "mlisp.h"
+
+/*
+ * Result caches of functions defined with defun-memo.
+ *
+ * A call is keyed by its argument values serialized into a byte string,
+ * so structurally equal arguments hit the same entry. Calls with
+ * arguments that can't be compared by structure (functions, primitives)
+ * or whose key is longer than MEMO_KEY_MAX are not cached.
+ *
+ * Each table holds at most MLISP_MEMO_SIZE entries and evicts the least
+ * recently used one. Int results are stored by value; other results are
+ * weak references, dropped by memo_forget_dead() when the collector finds
+ * nothing else refers to them.
+ */
+
+#define MEMO_KEY_MAX 256
+#define MEMO_DEFAULT_SIZE 4096
+
+typedef struct memo_entry_t {
+  unsigned long hash;
+  size_t len;
+  char *key;
+  int is_int;
+  int value;                    /* result if is_int */
+  obj_t *obj;                   /* result otherwise, weak */
+  struct memo_entry_t *chain;   /* next in the bucket */
+  struct memo_entry_t *prev;    /* LRU list, most recent first */
+  struct memo_entry_t *next;
+} memo_entry_t;
+
+typedef struct memo_t {
+  memo_entry_t **buckets;
+  size_t nbuckets;
+  size_t size;
+  size_t capacity;
+  memo_entry_t *head;
+  memo_entry_t *tail;
+  size_t hits;
+  size_t misses;
+  struct memo_t *prev_table;    /* all tables, for memo_forget_dead() */
+  struct memo_t *next_table;
+} memo_t;
+
+static memo_t *tables;
+static size_t capacity;
+
+typedef struct memo_key_t {
+  char buf[MEMO_KEY_MAX];
+  size_t len;
+} memo_key_t;
+
+static int put(memo_key_t *k, const void *p, size_t n)
+{
+  if (k->len + n > MEMO_KEY_MAX)
+    return 0;
+  memcpy(k->buf + k->len, p, n);
+  k->len += n;
+  return 1;
+}
+
+static int put_tag(memo_key_t *k, char tag)
+{
+  return put(k, &tag, 1);
+}
+
+/* append the structure of obj to the key, returns 0 if it can't be keyed */
+static int serialize(memo_key_t *k, obj_t *obj)
+{
+  for (;;) {
+    switch (type_of(obj)) {
+    case T_INT:
+      return put_tag(k, 'i') && put(k, &obj->value, sizeof(int));
+    case T_SYMBOL:
+      return put_tag(k, 's') && put(k, obj->name, strlen(obj->name) + 1);
+    case T_STRING:
+      return put_tag(k, 'q') && put(k, obj->name, strlen(obj->name) + 1);
+    case T_NIL:
+      return put_tag(k, 'n');
+    case T_TRUE:
+      return put_tag(k, 't');
+    case T_CELL:
+      /* recurse on car, loop on cdr */
+      if (!put_tag(k, '(') || !serialize(k, obj->car))
+        return 0;
+      obj = obj->cdr;
+      break;
+    default:
+      return 0;
+    }
+  }
+}
+
+static unsigned long hash_key(memo_key_t *k)
+{
+  unsigned long h = 14695981039346656037UL;
+  for (size_t i = 0; i < k->len; i++)
+    h = (h ^ (unsigned char)k->buf[i]) * 1099511628211UL;
+  return h;
+}
+
+memo_t *memo_new()
+{
+  if (capacity == 0) {
+    char *val = getenv("MLISP_MEMO_SIZE");
+    capacity = (val && val[0]) ? strtoul(val, NULL, 10) : MEMO_DEFAULT_SIZE;
+    if (capacity < 1)
+      capacity = 1;
+  }
+
+  memo_t *memo = calloc(1, sizeof(memo_t));
+  if (memo == NULL)
+    error("Failed to allocate memo table");
+  memo->capacity = capacity;
+  memo->nbuckets = 16;
+  while (memo->nbuckets < capacity)
+    memo->nbuckets *= 2;
+  memo->buckets = calloc(memo->nbuckets, sizeof(memo_entry_t *));
+  if (memo->buckets == NULL)
+    error("Failed to allocate memo table");
+
+  memo->next_table = tables;
+  if (tables)
+    tables->prev_table = memo;
+  tables = memo;
+  return memo;
+}
+
+static void unlink_lru(memo_t *memo, memo_entry_t *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    memo->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    memo->tail = e->prev;
+}
+
+static void push_lru(memo_t *memo, memo_entry_t *e)
+{
+  e->prev = NULL;
+  e->next = memo->head;
+  if (memo->head)
+    memo->head->prev = e;
+  memo->head = e;
+  if (memo->tail == NULL)
+    memo->tail = e;
+}
+
+static void remove_entry(memo_t *memo, memo_entry_t *e)
+{
+  memo_entry_t **p = &memo->buckets[e->hash & (memo->nbuckets - 1)];
+  while (*p != e)
+    p = &(*p)->chain;
+  *p = e->chain;
+
+  unlink_lru(memo, e);
+  memo->size--;
+  free(e->key);
+  free(e);
+}
+
+void memo_free(memo_t *memo)
+{
+  if (memo == NULL)
+    return;
+
+  while (memo->head)
+    remove_entry(memo, memo->head);
+
+  if (memo->prev_table)
+    memo->prev_table->next_table = memo->next_table;
+  else
+    tables = memo->next_table;
+  if (memo->next_table)
+    memo->next_table->prev_table = memo->prev_table;
+
+  free(memo->buckets);
+  free(memo);
+}
+
+static memo_entry_t *find(memo_t *memo, memo_key_t *k, unsigned long hash)
+{
+  memo_entry_t *e = memo->buckets[hash & (memo->nbuckets - 1)];
+  for (; e != NULL; e = e->chain) {
+    if (e->hash == hash && e->len == k->len && memcmp(e->key, k->buf, k->len) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+static void store(memo_t *memo, memo_key_t *k, unsigned long hash, obj_t *result)
+{
+  memo_entry_t *e = find(memo, k, hash);
+  if (e == NULL) {
+    if (memo->size == memo->capacity)
+      remove_entry(memo, memo->tail);
+
+    e = calloc(1, sizeof(memo_entry_t));
+    if (e == NULL || (e->key = malloc(k->len)) == NULL)
+      error("Failed to allocate memo entry");
+    memcpy(e->key, k->buf, k->len);
+    e->len = k->len;
+    e->hash = hash;
+    e->chain = memo->buckets[hash & (memo->nbuckets - 1)];
+    memo->buckets[hash & (memo->nbuckets - 1)] = e;
+    memo->size++;
+  } else {
+    unlink_lru(memo, e);
+  }
+  push_lru(memo, e);
+
+  e->is_int = type_of(result) == T_INT;
+  e->value = e->is_int ? result->value : 0;
+  e->obj = e->is_int ? NULL : result;
+}
+
+/* call a defun-memo function, answering from its table when possible */
+obj_t *memo_call(obj_t **env, obj_t *fn, obj_t *vals)
+{
+  memo_t *memo = fn->memo;
+  memo_key_t k;
+  k.len = 0;
+  if (!serialize(&k, vals))
+    return call_function(env, fn, vals);
+
+  unsigned long hash = hash_key(&k);
+  memo_entry_t *e = find(memo, &k, hash);
+  if (e != NULL) {
+    memo->hits++;
+    unlink_lru(memo, e);
+    push_lru(memo, e);
+    return e->is_int ? new_int(env, e->value) : e->obj;
+  }
+
+  memo->misses++;
+  obj_t *result = call_function(env, fn, vals);
+  store(memo, &k, hash, result);
+  return result;
+}
+
+/* called by the collector once marking is over */
+void memo_forget_dead()
+{
+  for (memo_t *memo = tables; memo != NULL; memo = memo->next_table) {
+    memo_entry_t *e = memo->head;
+    while (e != NULL) {
+      memo_entry_t *next = e->next;
+      if (!e->is_int && !gc_is_marked(e->obj))
+        remove_entry(memo, e);
+      e = next;
+    }
+  }
+}
+
+/* (hits misses entries) */
+obj_t *memo_stats(obj_t **env, memo_t *memo)
+{
+  obj_t *size = new_int(env, memo->size);
+  obj_t *misses = new_int(env, memo->misses);
+  obj_t *hits = new_int(env, memo->hits);
+  return new_cell(env, hits, new_cell(env, misses, new_cell(env, size, NIL)));
+}
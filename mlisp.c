@@ -1,146 +1,360 @@
 #include "mlisp.h"
-#include <sys/mman.h>
 
-obj_t *eval(obj_t **env, obj_t *obj);
-obj_t *prim_progn(struct obj_t **env, struct obj_t *args);
-
-static obj_t *NIL = &(obj_t) { T_NIL };
-static obj_t *TRUE = &(obj_t) { T_TRUE };
+obj_t *NIL;
+obj_t *TRUE;
 obj_t *Symbol;
+obj_t **global_env;             /* the top-level environment */
 
-size_t mem_used;
-void *memory;
-
-int GC_LOCK;
+/* when set, error() jumps here instead of exiting */
+jmp_buf *error_handler;
+char *error_message;
+volatile int eval_timeout;      /* set from a signal handler to stop evaluation */
+char *stack_limit;              /* eval fails below this address, NULL for no check */
 
-static int get_env_flag(char *name) {
+int get_env_flag(char *name) {
   char *val = getenv(name);
   return val && val[0];
 }
 
 void error(char *msg)
 {
+  if (error_handler) {
+    error_message = msg;
+    longjmp(*error_handler, 1);
+  }
+
   perror(msg);
   exit(1);
 }
 
-void *allocate_space()
+/* ints in this range are shared, so loop counters below 1024 don't allocate */
+#define SMALL_INT_MIN -128
+#define SMALL_INT_MAX 1023
+
+static obj_t *small_ints[SMALL_INT_MAX - SMALL_INT_MIN + 1];
+
+obj_t *new_int(obj_t **env, int v)
 {
-  return mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (v >= SMALL_INT_MIN && v <= SMALL_INT_MAX && small_ints[v - SMALL_INT_MIN])
+    return small_ints[v - SMALL_INT_MIN];
+
+  obj_t *obj = allocate(env, T_INT);
+  obj->value = v;
+  return obj;
 }
 
-void gc_clear_marked(obj_t **env)
+obj_t *new_symbol(obj_t **env, char *name)
 {
-  /* Maybe fix  NULL ... */
-  for (obj_t *o = memory; o == NULL; o = o->meta.next) {
-    o->meta.marked = UNMARK;
-  }
+  obj_t *obj = allocate(env, T_SYMBOL);
+  obj->name = strdup(name);
+  return obj;
 }
 
-void gc_mark(obj_t **env)
+/* takes ownership of str */
+obj_t *new_string(obj_t **env, char *str)
 {
-  gc_clear_marked(env);
-
-  for (obj_t *e = (*env); e->type != T_NIL; e = e->cdr) {
-    if (e->type == T_NIL)
-      return;
+  obj_t *obj = allocate(env, T_STRING);
+  obj->name = str;
+  return obj;
+}
 
-    e->car->meta.marked = MARK;
-  }
+obj_t *new_primitive(obj_t **env, primitive_t *fn)
+{
+  obj_t *obj = (obj_t *)allocate(env, T_PRIMITIVE);
+  obj->fn = fn;
+  return obj;
 }
 
-void gc_sweep()
+obj_t *new_cell(obj_t **env, obj_t *car, obj_t *cdr)
 {
-  /* The first address of memory should not be NULL */
-  obj_t *v = memory;
-  obj_t *prev = NULL;
+  obj_t *obj = allocate(env, T_CELL);
+  obj->car = car;
+  obj->cdr = cdr;
+  gc_write_barrier(obj, car);
+  gc_write_barrier(obj, cdr);
+  return obj;
+}
+
+/* variables bound by the enclosing lambdas and lets of a body */
+typedef struct scope_t {
+  obj_t *vars;                  /* (a b) or, for let, ((a 1) (b 2)) */
+  int let;
+  struct scope_t *up;
+} scope_t;
 
-  while (v->meta.next != NULL) {
-    if (v->meta.marked) {
-      if (prev != NULL)
-        prev->meta.next = v;
+typedef struct names_t {
+  char **names;
+  int len;
+  int cap;
+} names_t;
 
-      prev = v;
-    } else {
-      /* collected */
+static int in_scope(scope_t *scope, char *name)
+{
+  for (; scope != NULL; scope = scope->up) {
+    for (obj_t *v = scope->vars; type_of(v) == T_CELL; v = v->cdr) {
+      obj_t *var = scope->let ? v->car->car : v->car;
+      if (type_of(var) == T_SYMBOL && strcmp(var->name, name) == 0)
+        return 1;
     }
+  }
+  return 0;
+}
 
-    v = v->meta.next;
+static void add_name(names_t *names, char *name)
+{
+  for (int i = 0; i < names->len; i++) {
+    if (strcmp(names->names[i], name) == 0)
+      return;
   }
 
-  if (v->meta.marked == MARK) {
-    prev->meta.next = v;
-  } else {
-    prev->meta.next = NULL;
+  if (names->len == names->cap) {
+    names->cap = names->cap ? names->cap * 2 : 8;
+    names->names = realloc(names->names, names->cap * sizeof(char *));
+    if (names->names == NULL)
+      error("Failed to allocate free variables");
   }
+  names->names[names->len++] = name;
 }
 
-void gc(obj_t **env)
+/* collect the symbols of obj that are not bound by scope */
+static void free_variables(obj_t **env, obj_t *obj, scope_t *scope, names_t *names)
 {
-  if (GC_LOCK)
+  if (type_of(obj) == T_SYMBOL) {
+    if (!in_scope(scope, obj->name))
+      add_name(names, obj->name);
     return;
+  }
 
-  gc_mark(env);
-  gc_sweep();
+  if (type_of(obj) != T_CELL)
+    return;
+
+  if (type_of(obj->car) == T_SYMBOL && !in_scope(scope, obj->car->name)) {
+    obj_t *fn = lookup(env, obj->car->name);
+
+    if (fn != NULL && type_of(fn) == T_PRIMITIVE) {
+      if (fn->fn == prim_quote || fn->fn == prim_defmacro)
+        return;
+
+      int defun = fn->fn == prim_defun || fn->fn == prim_defun_memo;
+      if ((fn->fn == prim_lambda || defun) && type_of(obj->cdr) == T_CELL) {
+        obj_t *rest = defun ? obj->cdr->cdr : obj->cdr;
+        if (type_of(rest) != T_CELL)
+          return;
+        scope_t inner = { rest->car, 0, scope };
+        for (obj_t *b = rest->cdr; type_of(b) == T_CELL; b = b->cdr)
+          free_variables(env, b->car, &inner, names);
+        return;
+      }
+
+      if ((fn->fn == prim_dotimes || fn->fn == prim_dolist) && type_of(obj->cdr) == T_CELL &&
+          type_of(obj->cdr->car) == T_CELL) {
+        obj_t *spec = obj->cdr->car;
+        scope_t inner = { new_cell(env, spec->car, NIL), 0, scope };
+        if (type_of(spec->cdr) == T_CELL) {
+          free_variables(env, spec->cdr->car, scope, names);
+          free_variables(env, spec->cdr->cdr, &inner, names);
+        }
+        for (obj_t *b = obj->cdr->cdr; type_of(b) == T_CELL; b = b->cdr)
+          free_variables(env, b->car, &inner, names);
+        return;
+      }
+
+      if (fn->fn == prim_let && type_of(obj->cdr) == T_CELL) {
+        scope_t inner = { obj->cdr->car, 1, scope };
+        for (obj_t *v = obj->cdr->car; type_of(v) == T_CELL; v = v->cdr) {
+          if (type_of(v->car) == T_CELL && type_of(v->car->cdr) == T_CELL)
+            free_variables(env, v->car->cdr->car, scope, names);
+        }
+        for (obj_t *b = obj->cdr->cdr; type_of(b) == T_CELL; b = b->cdr)
+          free_variables(env, b->car, &inner, names);
+        return;
+      }
+    } else if (fn != NULL && type_of(fn) == T_MACRO) {
+      free_variables(env, macroexpand(env, obj), scope, names);
+      return;
+    }
+  }
+
+  for (; type_of(obj) == T_CELL; obj = obj->cdr)
+    free_variables(env, obj->car, scope, names);
+  free_variables(env, obj, scope, names);
 }
 
-obj_t *allocate(obj_t **env, type_t type)
+/*
+ * The free variables of each lambda form, worked out the first time a
+ * function is made from it. The names belong to interned symbols, which
+ * live as long as the interpreter; an entry goes when the collector
+ * finds its body dead, see capture_forget_dead().
+ *
+ * free_variables() reads call forms by what their head is bound to, so
+ * binding a name that is or becomes a macro or primitive bumps
+ * heads_generation and the names are worked out again.
+ */
+typedef struct free_entry_t {
+  obj_t *args;                  /* weak */
+  obj_t *body;                  /* weak */
+  unsigned long generation;
+  names_t names;
+  struct free_entry_t *chain;
+} free_entry_t;
+
+static unsigned long heads_generation;
+
+static free_entry_t **free_cache;
+static size_t free_cache_size;
+static size_t free_cache_len;
+
+static size_t free_bucket(obj_t *body, size_t size)
 {
-  size_t size = sizeof(obj_t);
-  obj_t *obj = (obj_t *)(memory + mem_used);
+  return ((uintptr_t)body >> 4) & (size - 1);
+}
 
-  /* GC always runs now */
-  if (1 || MEMORY_SIZE < (size + mem_used))
-    gc(env);
+static void free_cache_grow()
+{
+  size_t size = free_cache_size ? free_cache_size * 2 : 256;
+  free_entry_t **buckets = calloc(size, sizeof(free_entry_t *));
+  if (buckets == NULL)
+    error("Failed to allocate free variables");
+
+  for (size_t i = 0; i < free_cache_size; i++) {
+    for (free_entry_t *e = free_cache[i], *next; e != NULL; e = next) {
+      next = e->chain;
+      size_t b = free_bucket(e->body, size);
+      e->chain = buckets[b];
+      buckets[b] = e;
+    }
+  }
+  free(free_cache);
+  free_cache = buckets;
+  free_cache_size = size;
+}
 
-  mem_used += size;
-  obj->type = type;
-  obj->meta.marked = UNMARK;
-  if (MEMORY_SIZE < mem_used) {
-    /* TODO fix when compaction */
-    obj->meta.next = NULL;
-  } else {
-    obj->meta.next = (obj_t *)(memory + mem_used);
+static void note_head(obj_t *old, obj_t *val)
+{
+  if ((old && (type_of(old) == T_MACRO || type_of(old) == T_PRIMITIVE)) ||
+      type_of(val) == T_MACRO || type_of(val) == T_PRIMITIVE)
+    heads_generation++;
+}
+
+static names_t find_names(obj_t **env, obj_t *args, obj_t *body)
+{
+  names_t names = { NULL, 0, 0 };
+  scope_t scope = { args, 0, NULL };
+  for (obj_t *b = body; type_of(b) == T_CELL; b = b->cdr)
+    free_variables(env, b->car, &scope, &names);
+  return names;
+}
+
+static names_t *free_names(obj_t **env, obj_t *args, obj_t *body)
+{
+  if (free_cache_size > 0) {
+    for (free_entry_t *e = free_cache[free_bucket(body, free_cache_size)]; e != NULL; e = e->chain) {
+      if (e->body != body || e->args != args)
+        continue;
+      if (e->generation != heads_generation) {
+        names_t names = find_names(env, args, body);
+        free(e->names.names);
+        e->names = names;
+        e->generation = heads_generation;
+      }
+      return &e->names;
+    }
   }
 
-  return obj;
+  names_t names = find_names(env, args, body);
+  free_entry_t *e = malloc(sizeof(free_entry_t));
+  if (e == NULL) {
+    free(names.names);
+    error("Failed to allocate free variables");
+  }
+  if (free_cache_len >= free_cache_size)
+    free_cache_grow();
+  size_t b = free_bucket(body, free_cache_size);
+  *e = (free_entry_t) { args, body, heads_generation, names, free_cache[b] };
+  free_cache[b] = e;
+  free_cache_len++;
+  return &e->names;
 }
 
-obj_t *new_int(obj_t **env, int v)
+/* called by the collector once marking is over */
+void capture_forget_dead()
 {
-  obj_t *obj = allocate(env, T_INT);
-  obj->value = v;
-  return obj;
+  for (size_t i = 0; i < free_cache_size; i++) {
+    free_entry_t **p = &free_cache[i];
+    while (*p != NULL) {
+      free_entry_t *e = *p;
+      if (gc_is_marked(e->args) && gc_is_marked(e->body)) {
+        p = &e->chain;
+        continue;
+      }
+      *p = e->chain;
+      free(e->names.names);
+      free(e);
+      free_cache_len--;
+    }
+  }
 }
 
-obj_t *new_symbol(obj_t **env, char *name)
+void capture_reset()
 {
-  obj_t *obj = allocate(env, T_SYMBOL);
-  obj->name = strdup(name);
-  return obj;
+  for (size_t i = 0; i < free_cache_size; i++) {
+    for (free_entry_t *e = free_cache[i], *next; e != NULL; e = next) {
+      next = e->chain;
+      free(e->names.names);
+      free(e);
+    }
+  }
+  free(free_cache);
+  free_cache = NULL;
+  free_cache_size = free_cache_len = 0;
 }
 
-obj_t *new_primitive(obj_t **env, primitive_t *fn)
+/* the binding of name in env, searching no further than stop */
+obj_t *find_binding(obj_t *env, obj_t *stop, char *name)
 {
-  obj_t *obj = (obj_t *)allocate(env, T_PRIMITIVE);
-  obj->fn = fn;
-  return obj;
+  for (; env != stop && type_of(env) != T_NIL; env = env->cdr) {
+    obj_t *var = env->car;
+    if (type_of(var->car) == T_SYMBOL && strcmp(var->car->name, name) == 0)
+      return var;
+  }
+
+  return NULL;
 }
 
-obj_t *new_cell(obj_t **env, obj_t *car, obj_t *cdr)
+/*
+ * A function only keeps the local bindings its body refers to: the
+ * captured list holds the (name . value) cells themselves, so the
+ * function sees later assignments to them. Global variables are looked
+ * up when the function runs.
+ */
+obj_t *capture(obj_t **env, obj_t *args, obj_t *body)
 {
-  obj_t *obj = allocate(env, T_CELL);
-  obj->car = car;
-  obj->cdr = cdr;
-  return obj;
+  if (*env == *global_env)
+    return NIL;
+
+  names_t *names = free_names(env, args, body);
+  obj_t *captured = NIL;
+  for (int i = 0; i < names->len; i++) {
+    obj_t *var = find_binding(*env, *global_env, names->names[i]);
+    if (var != NULL)
+      captured = new_cell(env, var, captured);
+  }
+  return captured;
 }
 
 obj_t *new_function(obj_t **env, obj_t *args, obj_t *body)
 {
+  obj_t *captured = capture(env, args, body);
   obj_t *obj = allocate(env, T_FUNCTION);
   obj->args = args;
   obj->body = body;
-  obj->env = env;
+  obj->captured = captured;
+  obj->jit = NULL;
+  obj->memo = NULL;
+  obj->sym = NULL;
+  gc_write_barrier(obj, args);
+  gc_write_barrier(obj, body);
+  gc_write_barrier(obj, captured);
   return obj;
 }
 
@@ -149,18 +363,20 @@ obj_t *new_macro(obj_t **env, obj_t *args, obj_t *body)
   obj_t *obj = allocate(env, T_MACRO);
   obj->args = args;
   obj->body = body;
-  obj->env = env;
+  obj->captured = NIL;
+  obj->jit = NULL;
+  obj->memo = NULL;
+  obj->sym = NULL;
+  gc_write_barrier(obj, args);
+  gc_write_barrier(obj, body);
   return obj;
 }
 
 obj_t *intern(obj_t **env, char *name)
 {
-  for (obj_t *s = Symbol; s->type == T_NIL; s = s->cdr) {
-    if (s->type == T_NIL) {
-      break;
-    } else if (strcmp(s->car->name, name) == 0) {
-      return s;
-    }
+  for (obj_t *s = Symbol; type_of(s) != T_NIL; s = s->cdr) {
+    if (strcmp(s->car->name, name) == 0)
+      return s->car;
   }
 
   obj_t *sym = new_symbol(env, name);
@@ -178,8 +394,21 @@ obj_t *allocation(obj_t **env, node_t *node)
     return new_int(env, node->value);
   case NODE_SYMBOL:
     return intern(env, node->name);
-  case NODE_CELL:
-    return new_cell(env, allocation(env, node->car), allocation(env, node->cdr));
+  case NODE_STRING:
+    return new_string(env, strdup(node->name));
+  case NODE_CELL: {
+    /* build the list in place so long lists don't recurse on cdr */
+    obj_t *head = new_cell(env, allocation(env, node->car), NIL);
+    obj_t *tail = head;
+    for (node = node->cdr; node->type == NODE_CELL; node = node->cdr) {
+      tail->cdr = new_cell(env, allocation(env, node->car), NIL);
+      gc_write_barrier(tail, tail->cdr);
+      tail = tail->cdr;
+    }
+    tail->cdr = allocation(env, node);
+    gc_write_barrier(tail, tail->cdr);
+    return head;
+  }
   case NODE_NIL:
     return NIL;
   case NODE_TRUE:
@@ -190,33 +419,49 @@ obj_t *allocation(obj_t **env, node_t *node)
   }
 }
 
-void define_variable(obj_t **env, char *name, obj_t *value)
+obj_t *define_variable(obj_t **env, char *name, obj_t *value)
 {
+  note_head(lookup(env, name), value);
   obj_t *sym = intern(env, name);
   obj_t *val = new_cell(env, sym, value);
   *env = new_cell(env, val, *env);
+  return val;
 }
 
 obj_t *find_variable(obj_t *env, char *name)
 {
-  if (env->type == T_NIL)
-    return NULL;
+  obj_t *var = find_binding(env, NULL, name);
+  return var ? var->cdr : NULL;
+}
 
-  for (; env->type != T_NIL; env = env->cdr) {
-    obj_t *var = env->car;
-    if (var->car->type == T_SYMBOL && strcmp(var->car->name, name) == 0)
-      return var->cdr;
-  }
+/* local variables first, then globals */
+obj_t *lookup_binding(obj_t **env, char *name)
+{
+  obj_t *var = find_binding(*env, NULL, name);
+  if (var == NULL && *env != *global_env)
+    var = find_binding(*global_env, NULL, name);
+  return var;
+}
 
-  return NULL;
+obj_t *lookup(obj_t **env, char *name)
+{
+  obj_t *var = lookup_binding(env, name);
+  return var ? var->cdr : NULL;
 }
 
 obj_t *eval_list(obj_t **env, obj_t *args)
 {
-  if (args->type == T_NIL)
-    return NIL;
-
-  return new_cell(env, eval(env, args->car), eval_list(env, args->cdr));
+  obj_t *head = NIL, *tail = NIL;
+  for (; type_of(args) == T_CELL; args = args->cdr) {
+    obj_t *cell = new_cell(env, eval(env, args->car), NIL);
+    if (head == NIL)
+      head = cell;
+    else
+      tail->cdr = cell;
+    gc_write_barrier(tail, cell);
+    tail = cell;
+  }
+  return head;
 }
 
 /*
@@ -226,9 +471,11 @@ obj_t *apply_function(obj_t **env, obj_t *fn, obj_t *args)
 {
   obj_t *nenv = *env;
   obj_t *val = NIL, *arg = NIL;
-  for (; args->type != T_NIL; args = args->cdr) {
+  for (; type_of(args) == T_CELL; args = args->cdr) {
     arg = args->car;
-    val = new_cell(env, intern(env, arg->car->name), eval(env, arg->cdr->car));
+    if (type_of(arg) != T_CELL || type_of(arg->car) != T_SYMBOL || type_of(arg->cdr) != T_CELL)
+      error("let: Malformed binding");
+    val = new_cell(env, arg->car, eval(env, arg->cdr->car));
     nenv = new_cell(env, val, nenv);
   }
   return prim_progn(&nenv, fn);
@@ -238,10 +485,10 @@ obj_t *apply_macro(obj_t **env, obj_t *fn, obj_t *args)
 {
   obj_t *nenv = *env;
   obj_t *val = NIL, *arg = NIL;
-  for (; args->type != T_NIL; args = args->cdr) {
+  for (; type_of(args) == T_CELL; args = args->cdr) {
     arg = args->car;
     /* Macro doesn't call eval to its args */
-    val = new_cell(env, intern(env, arg->car->name), arg->cdr->car);
+    val = new_cell(env, arg->car, arg->cdr->car);
     nenv = new_cell(env, val, nenv);
   }
   return prim_progn(&nenv, fn);
@@ -253,21 +500,43 @@ obj_t *apply_macro(obj_t **env, obj_t *fn, obj_t *args)
 obj_t *transpose(obj_t **env, obj_t *l, obj_t* r)
 {
   obj_t *ret = NIL, *ne = NIL;
-  for (; l->type != T_NIL && r->type != T_NIL; l = l->cdr, r = r->cdr) {
+  for (; type_of(l) == T_CELL && type_of(r) == T_CELL; l = l->cdr, r = r->cdr) {
     ne = new_cell(env, l->car, new_cell(env, r->car, ret));
     ret = new_cell(env, ne, ret);
   }
   return ret;
 }
 
+/* call a user function with evaluated arguments */
+obj_t *call_function(obj_t **env, obj_t *fn, obj_t *vals)
+{
+  if (fn->memo == NULL) {
+    obj_t *ret = jit_call(env, fn, vals);
+    if (ret != NULL)
+      return ret;
+  }
+
+  unsigned site = heap_profiling ? prof_enter(fn) : gc_site;
+
+  /* the body sees its arguments and captured variables, then globals */
+  obj_t *e = fn->captured;
+  obj_t *params = fn->args;
+  for (; type_of(params) == T_CELL && type_of(vals) == T_CELL; params = params->cdr, vals = vals->cdr)
+    e = new_cell(env, new_cell(env, params->car, vals->car), e);
+  obj_t *ret = prim_progn(&e, fn->body);
+  gc_site = site;
+  return ret;
+}
+
 obj_t *apply(obj_t **env, obj_t *fn, obj_t *args)
 {
-  if (fn->type == T_PRIMITIVE) {
+  if (type_of(fn) == T_PRIMITIVE) {
     return fn->fn(env, args);
-  } else if (fn->type == T_FUNCTION){
-    obj_t *e = new_cell(env, *fn->env, *env);
-    obj_t *nargs = transpose(env, fn->args, eval_list(env, args));
-    return apply_function(&e, fn->body, nargs);
+  } else if (type_of(fn) == T_FUNCTION){
+    obj_t *vals = eval_list(env, args);
+    if (fn->memo)
+      return memo_call(env, fn, vals);
+    return call_function(env, fn, vals);
   } else {
     error("Not supported yet");
     return NULL;
@@ -276,11 +545,11 @@ obj_t *apply(obj_t **env, obj_t *fn, obj_t *args)
 
 obj_t *macroexpand(obj_t **env, obj_t *obj)
 {
-  if (obj->type != T_CELL || obj->car->type != T_SYMBOL)
+  if (type_of(obj) != T_CELL || type_of(obj->car) != T_SYMBOL)
     return obj;
 
-  obj_t *val = find_variable(*env, obj->car->name);
-  if (val == NULL || val->type != T_MACRO)
+  obj_t *val = lookup(env, obj->car->name);
+  if (val == NULL || type_of(val) != T_MACRO)
     return obj;
 
   obj_t *nargs = transpose(env, val->args, obj->cdr);
@@ -289,8 +558,14 @@ obj_t *macroexpand(obj_t **env, obj_t *obj)
 
 obj_t *eval(obj_t **env, obj_t *obj)
 {
-  switch(obj->type) {
+  if (eval_timeout)
+    error("Time limit exceeded");
+  if ((char *)&obj < stack_limit)
+    error("Stack overflow");
+
+  switch(type_of(obj)) {
   case T_INT:
+  case T_STRING:
     return obj;
   case T_NIL:
     return NIL;
@@ -298,9 +573,10 @@ obj_t *eval(obj_t **env, obj_t *obj)
     return TRUE;
   case T_FUNCTION:
   case T_PRIMITIVE:
+  case T_PROMISE:
     return obj;
   case T_SYMBOL: {
-    obj_t *primitve = find_variable(*env, obj->name);
+    obj_t *primitve = lookup(env, obj->name);
     if (primitve == NULL)
       error("Unkonw symbol");
 
@@ -314,51 +590,58 @@ obj_t *eval(obj_t **env, obj_t *obj)
     if (expanded != obj)
       return eval(env, expanded);
 
-    if (fn->type != T_PRIMITIVE && fn->type != T_FUNCTION)
+    if (type_of(fn) != T_PRIMITIVE && type_of(fn) != T_FUNCTION)
       error("The head of cons should be a function");
 
+    if (heap_profiling && type_of(fn) == T_PRIMITIVE)
+      return prof_apply(env, fn, obj);
     return apply(env, fn, obj->cdr);
   }
   default:
-    printf("%d\n", obj->type);
+    printf("%d\n", type_of(obj));
     error("Not implemented");
     return obj;
   }
 }
 
+/*
+ * Arithmetic and comparisons evaluate their arguments one at a time
+ * instead of building a list of them with eval_list().
+ */
+static int int_arg(obj_t **env, obj_t *arg, char *msg)
+{
+  obj_t *v = eval(env, arg);
+  if (type_of(v) != T_INT)
+    error(msg);
+  return v->value;
+}
+
 obj_t *prim_plus(struct obj_t **env, struct obj_t *args)
 {
   int v = 0;
-  for (obj_t *nargs = eval_list(env, args); nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_INT)
-      error("`+` is only used for int values");
-    v += nargs->car->value;
-  }
+  for (; type_of(args) == T_CELL; args = args->cdr)
+    v += int_arg(env, args->car, "`+` is only used for int values");
 
   return new_int(env, v);
 }
 
 obj_t *prim_minus(struct obj_t **env, struct obj_t *args)
 {
-  obj_t *nargs = eval_list(env, args);
-  int v = 0;
-  /* v1 - v2 - v3 = 0 - v1 - v2 - v3 + (v1 * 2) */
-  for (obj_t *lst = nargs; lst->type != T_NIL; lst = lst->cdr) {
-    if (lst->car->type != T_INT)
-      error("`-` is only used for int values");
-    v -= lst->car->value;
-  }
-  return new_int(env, v + (nargs->car->value * 2));
+  if (type_of(args) != T_CELL)
+    return new_int(env, 0);
+
+  /* v1 - v2 - v3, and v1 alone */
+  int v = int_arg(env, args->car, "`-` is only used for int values");
+  for (args = args->cdr; type_of(args) == T_CELL; args = args->cdr)
+    v -= int_arg(env, args->car, "`-` is only used for int values");
+  return new_int(env, v);
 }
 
 obj_t *prim_mul(struct obj_t **env, struct obj_t *args)
 {
   int v = 1;
-  for (obj_t *nargs = eval_list(env, args); nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_INT)
-      error("`*` is only used for int values");
-    v *= nargs->car->value;
-  }
+  for (; type_of(args) == T_CELL; args = args->cdr)
+    v *= int_arg(env, args->car, "`*` is only used for int values");
 
   return new_int(env, v);
 }
@@ -366,18 +649,16 @@ obj_t *prim_mul(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_div(struct obj_t **env, struct obj_t *args)
 {
-  if (args->car->type != T_INT)
-    error("`/` is only used for int values");
-  int v = args->car->value;
+  if (length(args) < 1)
+    error("/: Wrong number of arguments");
 
-  obj_t *nargs = eval_list(env, args);
-  for (obj_t *lst = nargs->cdr; lst->type != T_NIL;  lst = lst->cdr) {
-    if (lst->car->type == T_INT && lst->car->value == 0) {
+  int v = int_arg(env, args->car, "`/` is only used for int values");
+  for (args = args->cdr; type_of(args) == T_CELL; args = args->cdr) {
+    int d = int_arg(env, args->car, "`/` is only used for int values");
+    if (d == 0)
       error("Error: divided by 0");
-    } else  if (lst->car->type != T_INT) {
-      error("`/` is only used for int values");
-    }
-    v /= lst->car->value;
+    /* INT_MIN / -1 traps, wrap it around as `*` does */
+    v = d == -1 ? (int)(0U - (unsigned)v) : v / d;
   }
 
   return new_int(env, v);
@@ -385,16 +666,16 @@ obj_t *prim_div(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_equal(struct obj_t **env, struct obj_t *args)
 {
-  obj_t *nargs = eval_list(env, args);
   obj_t *v = NULL;
-  for (; nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_INT)
+  for (; type_of(args) == T_CELL; args = args->cdr) {
+    obj_t *n = eval(env, args->car);
+    if (type_of(n) != T_INT)
       error("= is only used for int values");
 
     if (v == NULL)
-      v = nargs->car;
+      v = n;
 
-    if (v->value != nargs->car->value)
+    if (v->value != n->value)
       return NIL;
   }
 
@@ -403,19 +684,16 @@ obj_t *prim_equal(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_lt(struct obj_t **env, struct obj_t *args)
 {
-  obj_t *nargs = eval_list(env, args);
   obj_t *v = NULL;
-  for (; nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_INT)
+  for (; type_of(args) == T_CELL; args = args->cdr) {
+    obj_t *n = eval(env, args->car);
+    if (type_of(n) != T_INT)
       error("< only takes int value");
 
-    if (v == NULL)
-      v = nargs->car;
-
-    if (v != nargs->car && v->value >= nargs->car->value)
+    if (v != NULL && v->value >= n->value)
       return NIL;
 
-    v = nargs->car;
+    v = n;
   }
 
   return TRUE;
@@ -423,19 +701,16 @@ obj_t *prim_lt(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_lte(struct obj_t **env, struct obj_t *args)
 {
-  obj_t *nargs = eval_list(env, args);
   obj_t *v = NULL;
-  for (; nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_INT)
+  for (; type_of(args) == T_CELL; args = args->cdr) {
+    obj_t *n = eval(env, args->car);
+    if (type_of(n) != T_INT)
       error("< only takes int value");
 
-    if (v == NULL)
-      v = nargs->car;
-
-    if (v != nargs->car && v->value > nargs->car->value)
+    if (v != NULL && v->value > n->value)
       return NIL;
 
-    v = nargs->car;
+    v = n;
   }
 
   return TRUE;
@@ -443,19 +718,16 @@ obj_t *prim_lte(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_gt(struct obj_t **env, struct obj_t *args)
 {
-  obj_t *nargs = eval_list(env, args);
   obj_t *v = NULL;
-  for (; nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_INT)
+  for (; type_of(args) == T_CELL; args = args->cdr) {
+    obj_t *n = eval(env, args->car);
+    if (type_of(n) != T_INT)
       error("< only takes int value");
 
-    if (v == NULL)
-      v = nargs->car;
-
-    if (v != nargs->car && v->value <= nargs->car->value)
+    if (v != NULL && v->value <= n->value)
       return NIL;
 
-    v = nargs->car;
+    v = n;
   }
 
   return TRUE;
@@ -463,46 +735,50 @@ obj_t *prim_gt(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_gte(struct obj_t **env, struct obj_t *args)
 {
-  obj_t *nargs = eval_list(env, args);
   obj_t *v = NULL;
-  for (; nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_INT)
+  for (; type_of(args) == T_CELL; args = args->cdr) {
+    obj_t *n = eval(env, args->car);
+    if (type_of(n) != T_INT)
       error("< only takes int value");
 
-    if (v == NULL)
-      v = nargs->car;
-
-    if (v != nargs->car && v->value < nargs->car->value)
+    if (v != NULL && v->value < n->value)
       return NIL;
 
-    v = nargs->car;
+    v = n;
   }
 
   return TRUE;
 }
 
+/* the number of elements of a list, -1 if it doesn't end with nil */
 int length(obj_t *lst)
 {
-  if (lst->type == T_NIL)
-    return 0;
-
-  return length(lst->cdr) + 1;
+  int len = 0;
+  for (; type_of(lst) == T_CELL; lst = lst->cdr)
+    len++;
+  return type_of(lst) == T_NIL ? len : -1;
 }
 
 obj_t *prim_car(struct obj_t **env, struct obj_t *args)
 {
+  if (length(args) != 1)
+    error("car: Wrong number of arguments");
+
   obj_t *v = eval(env, args->car);
-  if (v->type != T_CELL && v->type != T_NIL)
+  if (type_of(v) != T_CELL && type_of(v) != T_NIL)
     error("Wrong type argument");
-  return v->car;
+  return type_of(v) == T_CELL ? v->car : NIL;
 }
 
 obj_t *prim_cdr(struct obj_t **env, struct obj_t *args)
 {
+  if (length(args) != 1)
+    error("cdr: Wrong number of arguments");
+
   obj_t *v = eval(env, args->car);
-  if (v->type != T_CELL && v->type != T_NIL)
+  if (type_of(v) != T_CELL && type_of(v) != T_NIL)
     error("Wrong type argument");
-  return v->cdr;
+  return type_of(v) == T_CELL ? v->cdr : NIL;
 }
 
 obj_t *prim_cons(struct obj_t **env, struct obj_t *args)
@@ -524,7 +800,7 @@ obj_t *prim_quote(struct obj_t **env, struct obj_t *args)
 obj_t *prim_progn(struct obj_t **env, struct obj_t *args)
 {
   obj_t *ret = NIL;
-  for (; args->type != T_NIL ; args = args->cdr) {
+  for (; type_of(args) == T_CELL; args = args->cdr) {
     ret = eval(env, args->car);
   }
   return ret;
@@ -532,6 +808,9 @@ obj_t *prim_progn(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_let(struct obj_t **env, struct obj_t *args)
 {
+  if (length(args) < 1 || length(args->car) < 0)
+    error("let: Wrong number of arguments");
+
   return apply_function(env, args->cdr, args->car);
 }
 
@@ -542,8 +821,8 @@ obj_t *prim_if(struct obj_t **env, struct obj_t *args)
 
   obj_t *cond = eval(env, args->car);
 
-  if (cond->type == T_NIL) {
-    if (args->cdr->cdr->type == T_NIL)  /* without false clause */
+  if (type_of(cond) == T_NIL) {
+    if (type_of(args->cdr->cdr) == T_NIL)  /* without false clause */
       return NIL;
 
     obj_t *false_clause = args->cdr->cdr->car;
@@ -558,49 +837,182 @@ obj_t *prim_define(struct obj_t **env, struct obj_t *args)
 {
   if (length(args) != 2)
     error("define: Wrong number of arguments");
+  if (type_of(args->car) != T_SYMBOL)
+    error("define: Variable should be a symbol");
 
   obj_t *val = eval(env, args->cdr->car);
   define_variable(env, args->car->name, val);
   return val;
 }
 
+/* (setq name value) assigns to the innermost existing binding of name */
+obj_t *prim_setq(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 2)
+    error("setq: Wrong number of arguments");
+  if (type_of(args->car) != T_SYMBOL)
+    error("setq: Variable should be a symbol");
+
+  obj_t *var = lookup_binding(env, args->car->name);
+  if (var == NULL)
+    error("setq: Unbound variable");
+
+  obj_t *val = eval(env, args->cdr->car);
+  note_head(var->cdr, val);
+  var->cdr = val;
+  gc_write_barrier(var, val);
+  return val;
+}
+
+/* (while cond body...) */
+obj_t *prim_while(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) < 1)
+    error("while: Wrong number of arguments");
+
+  while (type_of(eval(env, args->car)) != T_NIL)
+    prim_progn(env, args->cdr);
+  return NIL;
+}
+
+/*
+ * The loops below bind their variable once and assign it on every
+ * iteration, like setq does. A dotimes counter is a new int each time,
+ * as the body may keep it: up to SMALL_INT_MAX it is one of the shared
+ * ints, past that every iteration allocates one.
+ */
+static obj_t *loop_binding(obj_t **env, obj_t *spec, obj_t **nenv, char *msg)
+{
+  if (type_of(spec) != T_CELL || type_of(spec->car) != T_SYMBOL || type_of(spec->cdr) != T_CELL)
+    error(msg);
+
+  obj_t *var = new_cell(env, spec->car, NIL);
+  *nenv = new_cell(env, var, *env);
+  return var;
+}
+
+/* (dotimes (var count [result]) body...) */
+obj_t *prim_dotimes(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) < 1)
+    error("dotimes: Wrong number of arguments");
+
+  obj_t *spec = args->car;
+  obj_t *nenv;
+  obj_t *var = loop_binding(env, spec, &nenv, "dotimes: Malformed variable spec");
+
+  obj_t *count = eval(env, spec->cdr->car);
+  if (type_of(count) != T_INT)
+    error("dotimes: Count should be an int");
+
+  int n = count->value;
+  for (int i = 0; i < n; i++) {
+    var->cdr = new_int(env, i);
+    gc_write_barrier(var, var->cdr);
+    prim_progn(&nenv, args->cdr);
+  }
+
+  var->cdr = new_int(env, n < 0 ? 0 : n);
+  gc_write_barrier(var, var->cdr);
+  return prim_progn(&nenv, spec->cdr->cdr);
+}
+
+/* (dolist (var list [result]) body...) */
+obj_t *prim_dolist(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) < 1)
+    error("dolist: Wrong number of arguments");
+
+  obj_t *spec = args->car;
+  obj_t *nenv;
+  obj_t *var = loop_binding(env, spec, &nenv, "dolist: Malformed variable spec");
+
+  obj_t *lst = eval(env, spec->cdr->car);
+  for (; type_of(lst) == T_CELL; lst = lst->cdr) {
+    var->cdr = lst->car;
+    gc_write_barrier(var, var->cdr);
+    prim_progn(&nenv, args->cdr);
+  }
+
+  var->cdr = NIL;
+  return prim_progn(&nenv, spec->cdr->cdr);
+}
+
+/* a list of symbols */
+static void check_params(obj_t *params)
+{
+  if (length(params) < 0)
+    error("Parameters should be a list");
+  for (; type_of(params) == T_CELL; params = params->cdr) {
+    if (type_of(params->car) != T_SYMBOL)
+      error("Parameter should be a symbol");
+  }
+}
+
 obj_t *prim_defun(struct obj_t **env, struct obj_t *args)
 {
   if (length(args) != 3)
     error("defun: Wrong number of arguments");
+  if (type_of(args->car) != T_SYMBOL)
+    error("defun: Name should be a symbol");
+  check_params(args->cdr->car);
 
+  /* bind the name first so that a local function can capture itself */
   obj_t *vargs = args->cdr->car;
   obj_t *body = args->cdr->cdr;
-  obj_t *fn = new_function(env, vargs, body);
-  define_variable(env, args->car->name, fn);
+  obj_t *var = define_variable(env, args->car->name, NIL);
+  var->cdr = new_function(env, vargs, body);
+  gc_write_barrier(var, var->cdr);
+  var->cdr->sym = args->car;
+  gc_write_barrier(var->cdr, args->car);
+  return NIL;
+}
+
+/* like defun, but calls are answered from a cache of earlier results */
+obj_t *prim_defun_memo(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 3)
+    error("defun-memo: Wrong number of arguments");
+
+  prim_defun(env, args);
+  obj_t *fn = find_variable(*env, args->car->name);
+  fn->memo = memo_new();
   return NIL;
 }
 
+/* (hits misses entries) of a defun-memo function */
+obj_t *prim_memo_stats(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("memo-stats: Wrong number of arguments");
+
+  obj_t *fn = eval(env, args->car);
+  if (type_of(fn) != T_FUNCTION || fn->memo == NULL)
+    error("memo-stats: Not a memoized function");
+  return memo_stats(env, fn->memo);
+}
+
 obj_t *prim_lambda(struct obj_t **env, struct obj_t *args)
 {
   if (length(args) != 2)
     error("lambda: Wrong number of arguments");
-
-  for (obj_t *nargs = args->car; nargs->type != T_NIL; nargs = nargs->cdr) {
-    if (nargs->car->type != T_SYMBOL)
-      error("Parameter should be a symbol");
-  }
+  check_params(args->car);
 
   return new_function(env, args->car, args->cdr);
 }
 
 obj_t *prim_list(struct obj_t **env, struct obj_t *args)
 {
-  if (args->type == T_NIL)
-    return args;
-
-  return new_cell(env, eval(env, args->car), prim_list(env, args->cdr));
+  return eval_list(env, args);
 }
 
 obj_t *prim_defmacro(struct obj_t **env, struct obj_t *args)
 {
   if (length(args) != 3)
     error("defmacro: Wrong number of arguments");
+  if (type_of(args->car) != T_SYMBOL)
+    error("defmacro: Name should be a symbol");
+  check_params(args->cdr->car);
 
   obj_t *vargs = args->cdr->car;
   obj_t *body = args->cdr->cdr;
@@ -611,6 +1023,9 @@ obj_t *prim_defmacro(struct obj_t **env, struct obj_t *args)
 
 obj_t *prim_macroexpand(struct obj_t **env, struct obj_t *args)
 {
+  if (length(args) != 1)
+    error("macroexpand: Wrong number of arguments");
+
   return macroexpand(env, eval(env, args->car));
 }
 
@@ -623,9 +1038,21 @@ void define_primitives(char *name, primitive_t *fn, obj_t **env)
 void initialize(obj_t **env)
 {
   GC_LOCK = 1;
-  memory = allocate_space();
-  mem_used = 0;
+  if (NIL == NULL) {
+    NIL = allocate(env, T_NIL);
+    TRUE = allocate(env, T_TRUE);
+    gc_add_root(&NIL);
+    gc_add_root(&TRUE);
+    for (int i = SMALL_INT_MIN; i <= SMALL_INT_MAX; i++) {
+      small_ints[i - SMALL_INT_MIN] = new_int(env, i);
+      gc_add_root(&small_ints[i - SMALL_INT_MIN]);
+    }
+  }
+  *env = NIL;
+  global_env = env;
   Symbol = NIL;
+  gc_add_root(env);
+  gc_add_root(&Symbol);
   define_primitives("+", prim_plus, env);
   define_primitives("-", prim_minus, env);
   define_primitives("*", prim_mul, env);
@@ -645,32 +1072,95 @@ void initialize(obj_t **env)
   define_primitives("lambda", prim_lambda, env);
   define_primitives("if", prim_if, env);
   define_primitives("define", prim_define, env);
+  define_primitives("setq", prim_setq, env);
+  define_primitives("set!", prim_setq, env);
+  define_primitives("while", prim_while, env);
+  define_primitives("dotimes", prim_dotimes, env);
+  define_primitives("dolist", prim_dolist, env);
   define_primitives("defun", prim_defun, env);
+  define_primitives("defun-memo", prim_defun_memo, env);
+  define_primitives("memo-stats", prim_memo_stats, env);
   define_primitives("defmacro", prim_defmacro, env);
   define_primitives("macroexpand", prim_macroexpand, env);
+  define_primitives("load", prim_load, env);
+  define_primitives("spawn", prim_spawn, env);
+  define_primitives("yield", prim_yield, env);
+  define_primitives("join", prim_join, env);
+  define_primitives("make-channel", prim_make_channel, env);
+  define_primitives("send", prim_send, env);
+  define_primitives("recv", prim_recv, env);
+  define_primitives("close", prim_close, env);
+  define_primitives("read-line", prim_read_line, env);
+  define_primitives("delay", prim_delay, env);
+  define_primitives("force", prim_force, env);
+  define_primitives("cons-stream", prim_cons_stream, env);
+  define_primitives("stream-car", prim_stream_car, env);
+  define_primitives("stream-cdr", prim_stream_cdr, env);
+  define_primitives("stream-map", prim_stream_map, env);
+  define_primitives("stream-filter", prim_stream_filter, env);
+  define_primitives("stream-take", prim_stream_take, env);
+  define_primitives("stream-fold", prim_stream_fold, env);
+  define_primitives("stream->list", prim_stream_to_list, env);
+  define_primitives("read-stream", prim_read_stream, env);
+  define_primitives("heap-dump", prim_heap_dump, env);
   GC_LOCK = 0;
 }
 
-int main(int argc, char *argv[])
+/* the snapshot is a root until drop_snapshot() */
+void save_snapshot(snapshot_t *snap, obj_t *env)
 {
-  node_t *node = parse();
+  snap->env = env;
+  snap->symbol = Symbol;
+  snap->values = NIL;
+  gc_add_root(&snap->values);
+
+  for (obj_t *e = env; type_of(e) == T_CELL; e = e->cdr) {
+    obj_t *var = e->car;
+    obj_t *pair = new_cell(&snap->env, var, var->cdr);
+    snap->values = new_cell(&snap->env, pair, snap->values);
+  }
+}
 
-  if (get_env_flag("MLISP_PARSE_TEST")) {
-    print_node(node);
-    return 0;
+/*
+ * Forget everything defined since the snapshot was taken, undo the
+ * assignments to its bindings and return its environment. What was
+ * allocated since is left to the collector.
+ */
+obj_t *restore_snapshot(snapshot_t *snap)
+{
+  for (obj_t *v = snap->values; type_of(v) == T_CELL; v = v->cdr) {
+    obj_t *var = v->car->car;
+    var->cdr = v->car->cdr;
+    gc_write_barrier(var, var->cdr);
   }
 
-  obj_t *env = NIL;
+  Symbol = snap->symbol;
+  return snap->env;
+}
 
-  initialize(&env);
-  obj_t *obj = allocation(&env, node);
-  obj_t *ret = eval(&env, obj);
+void drop_snapshot(snapshot_t *snap)
+{
+  gc_remove_root(&snap->values);
+  snap->values = NULL;
+}
 
-  if (get_env_flag("MLISP_EVAL_TEST")) {
-    print_obj(ret);
-    return 0;
-  }
+/* drop the coroutines, channels and open streams an evaluation left behind */
+void reset_evaluation()
+{
+  coro_reset();
+  stream_reset();
+}
 
-  print_obj(ret);
-  return 0;
+/* free everything initialize() and evaluation created */
+void deinitialize()
+{
+  reset_evaluation();
+  prof_reset();
+  capture_reset();
+  gc_free_all();
+  jit_reset();
+  NIL = TRUE = Symbol = NULL;
+  memset(small_ints, 0, sizeof(small_ints));
+  global_env = NULL;
+  error_handler = NULL;
 }
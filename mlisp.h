@@ -5,12 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <setjmp.h>
+#include <stdint.h>
 
 #define MEMORY_SIZE 65536
 
 typedef enum {
   NODE_INT,
   NODE_SYMBOL,
+  NODE_STRING,
   NODE_CELL,
 
   NODE_NIL,
@@ -26,7 +29,7 @@ typedef struct node_t {
   union {
     int value;                  /* store integer */
 
-    char *name;                 /* store string */
+    char *name;                 /* store symbol name or string */
 
     struct {                    /* store cell */
       struct node_t *car;
@@ -38,61 +41,193 @@ typedef struct node_t {
 typedef enum {
   T_INT,
   T_SYMBOL,
+  T_STRING,
   T_PRIMITIVE,
   T_MACRO,
   T_FUNCTION,
   T_CELL,
+  T_PROMISE,
   T_MOVED,
 
   T_NIL,
-  T_TRUE
+  T_TRUE,
+
+  T_NTYPES                      /* number of types */
 } type_t;
 
 
 typedef struct obj_t *primitive_t(struct obj_t **env, struct obj_t *args);
 
-typedef enum gc_mark_t {
-  MARK,
-  UNMARK
-} gc_mark_t;
-
-/* mlisp object */
+/*
+ * mlisp object. Objects have no header: the heap page an object lives in
+ * tells its type, see type_of(), and only the arm of the union used by
+ * that type is allocated.
+ */
 typedef struct obj_t {
-  type_t type;
-
-  struct {
-    gc_mark_t marked;
-    struct obj_t *next;         /* next object ptr */
-  } meta;
-
   union {
     int value;                  /* store integer */
 
-    char *name;                 /* store string */
+    char *name;                 /* store symbol name or string */
 
     primitive_t *fn;            /* store primitive (function) */
 
     struct {
       struct obj_t *args;
       struct obj_t *body;
-      struct obj_t **env;
+      struct obj_t *captured;   /* bindings of free variables */
+      struct jit_fn *jit;       /* compiled code, see jit.c */
+      struct memo_t *memo;      /* result cache of defun-memo, see memo.c */
+      struct obj_t *sym;        /* name it was defined with, or NULL */
     };
 
     struct {                    /* store cell */
       struct obj_t *car;
-      struct obj_t *cdr;
+      struct obj_t *cdr;        /* for a promise, its thunk until forced, see stream.c */
     };
   };
 } obj_t;
 
+static inline type_t type_of(obj_t *obj)
+{
+  /* every heap page starts with the type of its objects, see gc.c */
+  return *(type_t *)((uintptr_t)obj & ~(uintptr_t)(MEMORY_SIZE - 1));
+}
+
+/* printer options */
+typedef struct print_opt_t {
+  int length;                   /* max elements printed per list, 0 for all */
+  int depth;                    /* max nesting printed, 0 for all */
+  int compact;                  /* abbreviate quote forms and functions */
+} print_opt_t;
+
+/* state that an environment can be reset to */
+typedef struct snapshot_t {
+  obj_t *env;
+  obj_t *symbol;
+  obj_t *values;                /* ((binding . value) ...) of env */
+} snapshot_t;
+
 /* mlisp.c */
+extern obj_t *NIL, *TRUE;
+extern jmp_buf *error_handler;
+extern char *error_message;
+extern volatile int eval_timeout;
+extern char *stack_limit;
 void error(char *msg);
+int get_env_flag(char *name);
+void initialize(obj_t **env);
+void define_primitives(char *name, primitive_t *fn, obj_t **env);
+obj_t *allocation(obj_t **env, node_t *node);
+obj_t *eval(obj_t **env, obj_t *obj);
+obj_t *call_function(obj_t **env, obj_t *fn, obj_t *vals);
+void save_snapshot(snapshot_t *snap, obj_t *env);
+obj_t *restore_snapshot(snapshot_t *snap);
+void drop_snapshot(snapshot_t *snap);
+void reset_evaluation();
+void deinitialize();
+obj_t *new_int(obj_t **env, int v);
+obj_t *new_cell(obj_t **env, obj_t *car, obj_t *cdr);
+obj_t *new_string(obj_t **env, char *str);
+obj_t *new_primitive(obj_t **env, primitive_t *fn);
+obj_t *new_function(obj_t **env, obj_t *args, obj_t *body);
+obj_t *intern(obj_t **env, char *name);
+extern obj_t **global_env;
+obj_t *find_binding(obj_t *env, obj_t *stop, char *name);
+void capture_forget_dead();
+void capture_reset();
+obj_t *find_variable(obj_t *env, char *name);
+obj_t *lookup(obj_t **env, char *name);
+obj_t *macroexpand(obj_t **env, obj_t *obj);
+int length(obj_t *lst);
+obj_t *eval_list(obj_t **env, obj_t *args);
+primitive_t prim_plus, prim_minus, prim_mul, prim_equal;
+primitive_t prim_lt, prim_lte, prim_gt, prim_gte;
+primitive_t prim_if, prim_progn, prim_quote, prim_let, prim_lambda;
+primitive_t prim_defun, prim_defun_memo, prim_defmacro, prim_dotimes, prim_dolist;
+
+/* gc.c */
+extern int GC_LOCK;
+extern size_t stat_allocs, stat_bytes, stat_gcs;
+extern long stat_gc_max_pause_us, stat_gc_total_us;
+obj_t *allocate(obj_t **env, type_t type);
+void gc();
+void gc_add_root(obj_t **root);
+void gc_remove_root(obj_t **root);
+void gc_mark_object(obj_t *obj);
+void gc_mark_range(void *lo, void *hi);
+void gc_write_barrier(obj_t *parent, obj_t *child);
+int gc_is_marked(obj_t *obj);
+size_t gc_heap_size();
+void gc_set_stack_top(void *top);
+void *gc_stack_top();
+void gc_free_all();
+void gc_set_alloc_limit(size_t n);
+extern int heap_profiling;
+extern unsigned gc_site;
+void gc_each_object(void (*fn)(obj_t *obj, size_t bytes, unsigned site, void *arg), void *arg);
+void gc_retained(obj_t **vals, size_t n, size_t *bytes);
 
 /* parse.c */
 node_t *parse();
+FILE *set_parse_input(FILE *fp);
+void destory_ast(node_t *node);
+
+/* jit.c */
+extern int jit_compiled;
+obj_t *jit_call(obj_t **env, obj_t *fn, obj_t *vals);
+void jit_mark(struct jit_fn *info);
+void jit_reset();
+
+/* memo.c */
+struct memo_t *memo_new();
+void memo_free(struct memo_t *memo);
+obj_t *memo_call(obj_t **env, obj_t *fn, obj_t *vals);
+void memo_forget_dead();
+obj_t *memo_stats(obj_t **env, struct memo_t *memo);
+
+/* load.c */
+extern size_t stat_loads, stat_load_cached;
+primitive_t prim_load;
+void load_file(char *path);
+obj_t *eval_string(obj_t **env, const char *src, size_t len);
+
+/* coro.c */
+void *coro_stack_top();
+void coro_mark();
+void coro_forget_dead();
+void coro_reset();
+primitive_t prim_spawn, prim_yield, prim_join;
+primitive_t prim_make_channel, prim_send, prim_recv, prim_close, prim_read_line;
+
+/* stream.c */
+obj_t *force(obj_t **env, obj_t *obj);
+void stream_reset();
+primitive_t prim_delay, prim_force, prim_cons_stream, prim_stream_car, prim_stream_cdr;
+primitive_t prim_stream_map, prim_stream_filter, prim_stream_take, prim_stream_fold;
+primitive_t prim_stream_to_list, prim_read_stream;
+
+/* prof.c */
+unsigned prof_enter(obj_t *fn);
+obj_t *prof_apply(obj_t **env, obj_t *fn, obj_t *form);
+void prof_reset();
+void heap_dump(FILE *fp);
+primitive_t prim_heap_dump;
+
+/* batch.c */
+int run_batch(char *path);
+
+/* server.c */
+int run_server(char *path, int workers, char **files, int nfiles);
+int run_client(char *path);
 
 /* debug */
 void print_node(node_t *node);
 void print_obj(obj_t *obj);
+void fprint_node(FILE *fp, node_t *node);
+void fprint_obj(FILE *fp, obj_t *obj);
+void fprint_obj_opt(FILE *fp, obj_t *obj, print_opt_t *opt);
+char *sprint_node(node_t *node, print_opt_t *opt);
+char *sprint_obj(obj_t *obj, print_opt_t *opt);
+print_opt_t default_print_opt();
 
 #endif  /* MLISP_H */
@@ -7,11 +7,25 @@ static node_t *True = &(node_t){ NODE_TRUE };
 static node_t *RParen = &(node_t){ NODE_RPAREN };
 static node_t *Dot = &(node_t){ NODE_DOT };
 
-static char symbol_chars[] = "+-*/<=>";
+static char symbol_chars[] = "+-*/<=>!";
+
+static FILE *input;
+
+/* set the stream parse() reads from and return the previous one */
+FILE *set_parse_input(FILE *fp)
+{
+  FILE *prev = input ? input : stdin;
+  input = fp;
+  return prev;
+}
+
+static char next() {
+  return getc(input ? input : stdin);
+}
 
 static char peek() {
-  char c = getchar();
-  ungetc(c, stdin);
+  char c = next();
+  ungetc(c, input ? input : stdin);
   return c;
 }
 
@@ -23,6 +37,14 @@ node_t *new_node_symbol(char *sym)
   return node;
 }
 
+node_t *new_node_string(char *str)
+{
+  node_t* node = (node_t *)malloc(sizeof(node_t));
+  node->name = str;
+  node->type = NODE_STRING;
+  return node;
+}
+
 node_t *new_node_int(int value)
 {
   node_t* node = malloc(sizeof(node_t));
@@ -48,22 +70,35 @@ node_t *parse_quote()
 
 node_t *parse_list()
 {
-  node_t *node = parse();
+  node_t *head = Nil, *tail = Nil;
+
+  for (;;) {
+    node_t *node = parse();
+    node_t *cdr = Nil;
 
-  if (node == NULL) {
-    error("Paren is Unmatch");
-  } else if (node == Dot) {   /* (a . b) */
-    node_t *cdr = parse();
-    if (parse() != RParen) {
+    if (node == NULL) {
       error("Paren is Unmatch");
-      exit(1);
+    } else if (node == Dot) {   /* (a . b) */
+      cdr = parse();
+      if (parse() != RParen) {
+        error("Paren is Unmatch");
+        exit(1);
+      }
+    } else if (node != RParen) {
+      node_t *cell = new_node_cell(node, Nil);
+      if (head == Nil)
+        head = cell;
+      else
+        tail->cdr = cell;
+      tail = cell;
+      continue;
     }
-    return cdr;
-  } else if (node == RParen) {
-    return Nil;
-  }
 
-  return new_node_cell(node, parse_list());
+    if (head == Nil)
+      return cdr;
+    tail->cdr = cdr;
+    return head;
+  }
 }
 
 node_t *parse_symbol(char v)
@@ -74,7 +109,7 @@ node_t *parse_symbol(char v)
   while (isalpha(peek()) || isdigit(peek()) || strchr(symbol_chars, peek())) {
     if (i >= SYMBOL_MAX_LEN)
       error("Symbol name is too long");
-    buf[i++] = getchar();
+    buf[i++] = next();
   }
   buf[i] = '\0';
 
@@ -84,9 +119,40 @@ node_t *parse_symbol(char v)
   return new_node_symbol(buf);
 }
 
+/* "..." with \" \\ and \n escapes, the opening quote already read */
+node_t *parse_string()
+{
+  size_t len = 0, cap = 16;
+  char *buf = malloc(cap);
+
+  for (;;) {
+    int c = getc(input ? input : stdin);
+    if (c == EOF) {
+      free(buf);
+      error("Unterminated string");
+    }
+    if (c == '"')
+      break;
+    if (c == '\\') {
+      c = getc(input ? input : stdin);
+      if (c == 'n')
+        c = '\n';
+      else if (c == EOF)
+        continue;
+    }
+
+    if (len + 1 >= cap)
+      buf = realloc(buf, cap *= 2);
+    buf[len++] = c;
+  }
+
+  buf[len] = '\0';
+  return new_node_string(buf);
+}
+
 int num(int acc) {
-  if (isdigit(peek()))
-    return num(acc * 10 + (getchar() - '0'));
+  while (isdigit(peek()))
+    acc = acc * 10 + (next() - '0');
 
   return acc;
 }
@@ -103,11 +169,17 @@ void destory_ast(node_t *node)
 
   switch(node->type) {
   case NODE_CELL:
-    destory_ast(node->car);
-    destory_ast(node->cdr);
-    free(node);
+    /* recurse on car only, lists are freed in a loop */
+    while (node->type == NODE_CELL) {
+      node_t *cdr = node->cdr;
+      destory_ast(node->car);
+      free(node);
+      node = cdr;
+    }
+    destory_ast(node);
     return;
   case NODE_SYMBOL:
+  case NODE_STRING:
     free(node->name);
     free(node);
     return;
@@ -122,18 +194,20 @@ void destory_ast(node_t *node)
 
 node_t *parse()
 {
-  char c = getchar();
+  char c = next();
+  while (isspace(c))
+    c = next();
 
   if (c == '(') {
     if (peek() == ')') {
-      getchar();
+      next();
       return Nil;
     }
     return parse_list();
-  } else if (c == ' ') {
-    return parse();
   } else if (c == '\'') {
     return parse_quote();
+  } else if (c == '"') {
+    return parse_string();
   } else if (c == ')') {
     return RParen;
   } else if (c == '.') {
@@ -0,0 +1,318 @@
+#include "mlisp.h"
+
+/*
+ * Heap profiler.
+ *
+ * With MLISP_HEAP_PROFILE set, every object is tagged with its allocation
+ * site: the user function that was running, by the name it was defun'd
+ * with, and the primitive it was calling if any, as in "walk/cons".
+ * Objects made outside any function belong to "toplevel", and those made
+ * by calls to anonymous functions to "lambda".
+ *
+ * (heap-dump) writes a census of the live objects to stderr, or to a file
+ * with (heap-dump "path"):
+ *
+ * - objects and bytes by type
+ * - objects and bytes by allocation site and type, with MLISP_HEAP_PROFILE
+ * - the bytes retained by each top-level binding, what would be freed
+ *   without it
+ *
+ * With MLISP_HEAP_PROFILE the census is also written to stderr at exit.
+ */
+
+#define TOP_SITES 20
+#define TOP_BINDINGS 20
+#define MAX_SITES 65536         /* sites are stored in 16 bits, see gc.c */
+
+typedef struct site_t {
+  char *fn;
+  char *prim;                   /* NULL for the function itself */
+  unsigned long hash;
+  size_t objects[T_NTYPES];
+  size_t bytes[T_NTYPES];
+} site_t;
+
+static site_t *sites;
+static size_t nsites;
+static size_t sites_cap;
+static unsigned *buckets;       /* site + 1, 0 for empty */
+static size_t nbuckets;
+
+static const char *type_names[T_NTYPES] = {
+  [T_INT] = "int",
+  [T_SYMBOL] = "symbol",
+  [T_STRING] = "string",
+  [T_PRIMITIVE] = "primitive",
+  [T_MACRO] = "macro",
+  [T_FUNCTION] = "function",
+  [T_CELL] = "cell",
+  [T_PROMISE] = "promise",
+  [T_MOVED] = "moved",
+  [T_NIL] = "nil",
+  [T_TRUE] = "true",
+};
+
+static unsigned long hash_str(unsigned long h, const char *s)
+{
+  for (; s && *s; s++)
+    h = (h ^ (unsigned char)*s) * 1099511628211UL;
+  return h;
+}
+
+static int same(const char *a, const char *b)
+{
+  return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static void rehash()
+{
+  free(buckets);
+  nbuckets = nbuckets ? nbuckets * 2 : 1024;
+  buckets = calloc(nbuckets, sizeof(unsigned));
+  if (buckets == NULL)
+    error("Failed to allocate heap profile");
+
+  for (size_t i = 0; i < nsites; i++) {
+    size_t b = sites[i].hash & (nbuckets - 1);
+    while (buckets[b])
+      b = (b + 1) & (nbuckets - 1);
+    buckets[b] = i + 1;
+  }
+}
+
+/* the id of the site of fn calling prim */
+static unsigned site_id(char *fn, char *prim)
+{
+  unsigned long h = hash_str(hash_str(14695981039346656037UL, fn) * 31, prim);
+  size_t b = nbuckets ? h & (nbuckets - 1) : 0;
+  for (; nbuckets && buckets[b]; b = (b + 1) & (nbuckets - 1)) {
+    site_t *s = &sites[buckets[b] - 1];
+    if (s->hash == h && same(s->fn, fn) && same(s->prim, prim))
+      return buckets[b] - 1;
+  }
+
+  /* the last site, "other", takes whatever doesn't fit */
+  if (nsites == MAX_SITES)
+    return MAX_SITES - 1;
+  if (nsites == MAX_SITES - 1) {
+    fn = "other";
+    prim = NULL;
+  }
+
+  if (nsites == sites_cap) {
+    sites_cap = sites_cap ? sites_cap * 2 : 256;
+    sites = realloc(sites, sites_cap * sizeof(site_t));
+    if (sites == NULL)
+      error("Failed to allocate heap profile");
+  }
+  site_t *s = &sites[nsites++];
+  memset(s, 0, sizeof(site_t));
+  s->fn = strdup(fn);
+  s->prim = prim ? strdup(prim) : NULL;
+  s->hash = h;
+
+  if (nsites * 2 > nbuckets)
+    rehash();
+  else
+    buckets[b] = nsites;
+  return nsites - 1;
+}
+
+static void setup()
+{
+  if (nsites == 0)
+    site_id("toplevel", NULL);
+}
+
+/* what fn allocates from now on belongs to it */
+unsigned prof_enter(obj_t *fn)
+{
+  setup();
+  unsigned prev = gc_site;
+  gc_site = site_id(fn->sym ? fn->sym->name : "lambda", NULL);
+  return prev;
+}
+
+/* apply the primitive fn in the call form, as a site of its own */
+obj_t *prof_apply(obj_t **env, obj_t *fn, obj_t *form)
+{
+  setup();
+  unsigned prev = gc_site;
+  char *name = type_of(form->car) == T_SYMBOL ? form->car->name : "primitive";
+  gc_site = site_id(sites[prev].fn, name);
+  obj_t *ret = fn->fn(env, form->cdr);
+  gc_site = prev;
+  return ret;
+}
+
+void prof_reset()
+{
+  for (size_t i = 0; i < nsites; i++) {
+    free(sites[i].fn);
+    free(sites[i].prim);
+  }
+  free(sites);
+  free(buckets);
+  sites = NULL;
+  buckets = NULL;
+  nsites = sites_cap = nbuckets = 0;
+  gc_site = 0;
+}
+
+typedef struct census_t {
+  size_t objects[T_NTYPES];
+  size_t bytes[T_NTYPES];
+} census_t;
+
+static void count(obj_t *obj, size_t bytes, unsigned site, void *arg)
+{
+  census_t *c = arg;
+  type_t t = type_of(obj);
+  c->objects[t]++;
+  c->bytes[t] += bytes;
+  if (site < nsites) {
+    sites[site].objects[t]++;
+    sites[site].bytes[t] += bytes;
+  }
+}
+
+typedef struct entry_t {
+  size_t index;
+  size_t bytes;
+} entry_t;
+
+static int by_bytes(const void *a, const void *b)
+{
+  size_t x = ((entry_t *)a)->bytes, y = ((entry_t *)b)->bytes;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void print_sites(FILE *fp)
+{
+  entry_t *top = malloc(nsites * T_NTYPES * sizeof(entry_t));
+  size_t n = 0;
+  if (top == NULL)
+    return;
+
+  for (size_t i = 0; i < nsites * T_NTYPES; i++) {
+    if (sites[i / T_NTYPES].objects[i % T_NTYPES] > 0)
+      top[n++] = (entry_t) { i, sites[i / T_NTYPES].bytes[i % T_NTYPES] };
+  }
+  qsort(top, n, sizeof(entry_t), by_bytes);
+
+  fprintf(fp, "\n%-32s %-10s %12s %12s\n", "site", "type", "objects", "bytes");
+  for (size_t i = 0; i < n && i < TOP_SITES; i++) {
+    site_t *s = &sites[top[i].index / T_NTYPES];
+    int t = top[i].index % T_NTYPES;
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s%s", s->fn, s->prim ? "/" : "", s->prim ? s->prim : "");
+    fprintf(fp, "%-32s %-10s %12zu %12zu\n", name, type_names[t], s->objects[t], s->bytes[t]);
+  }
+  free(top);
+}
+
+/* what each top-level binding keeps alive, measured with its value taken out */
+static void print_bindings(FILE *fp)
+{
+  size_t n = 0;
+  for (obj_t *e = *global_env; type_of(e) == T_CELL; e = e->cdr)
+    n++;
+
+  obj_t **cells = malloc(n * sizeof(obj_t *));
+  obj_t **vals = malloc(n * sizeof(obj_t *));
+  size_t *bytes = malloc(n * sizeof(size_t));
+  entry_t *top = malloc(n * sizeof(entry_t));
+  if (n == 0 || !cells || !vals || !bytes || !top)
+    goto out;
+
+  size_t i = 0;
+  for (obj_t *e = *global_env; type_of(e) == T_CELL; e = e->cdr, i++) {
+    cells[i] = e;
+    vals[i] = e->car->cdr;
+    e->car->cdr = NIL;
+  }
+
+  /* put the values back before passing errors on */
+  jmp_buf jb, *prev = error_handler;
+  error_handler = &jb;
+  if (setjmp(jb) != 0) {
+    error_handler = prev;
+    for (i = 0; i < n; i++)
+      cells[i]->car->cdr = vals[i];
+    error(error_message);
+  }
+  gc_retained(vals, n, bytes);
+  error_handler = prev;
+  for (i = 0; i < n; i++) {
+    cells[i]->car->cdr = vals[i];
+    top[i] = (entry_t) { i, bytes[i] };
+  }
+  qsort(top, n, sizeof(entry_t), by_bytes);
+
+  fprintf(fp, "\n%-32s %12s\n", "binding", "retained");
+  int shown = 0;
+  for (i = 0; i < n && shown < TOP_BINDINGS && top[i].bytes > 0; i++) {
+    obj_t *cell = cells[top[i].index], *var = cell->car;
+    if (type_of(var->cdr) == T_PRIMITIVE)
+      continue;
+    shown++;
+    /* an earlier definition of the name, still in the environment */
+    int shadowed = find_binding(*global_env, cell, var->car->name) != NULL;
+    char name[64];
+    snprintf(name, sizeof(name), "%s%s", var->car->name, shadowed ? " (shadowed)" : "");
+    fprintf(fp, "%-32s %12zu\n", name, top[i].bytes);
+  }
+
+out:
+  free(cells);
+  free(vals);
+  free(bytes);
+  free(top);
+}
+
+void heap_dump(FILE *fp)
+{
+  census_t c = { { 0 }, { 0 } };
+  for (size_t i = 0; i < nsites; i++) {
+    memset(sites[i].objects, 0, sizeof(sites[i].objects));
+    memset(sites[i].bytes, 0, sizeof(sites[i].bytes));
+  }
+  gc_each_object(count, &c);
+
+  size_t objects = 0, bytes = 0;
+  for (int t = 0; t < T_NTYPES; t++) {
+    objects += c.objects[t];
+    bytes += c.bytes[t];
+  }
+  fprintf(fp, "heap: %zu objects, %zu bytes\n", objects, bytes);
+  fprintf(fp, "\n%-32s %12s %12s\n", "type", "objects", "bytes");
+  for (int t = 0; t < T_NTYPES; t++) {
+    if (c.objects[t] > 0)
+      fprintf(fp, "%-32s %12zu %12zu\n", type_names[t], c.objects[t], c.bytes[t]);
+  }
+
+  if (heap_profiling)
+    print_sites(fp);
+  print_bindings(fp);
+  fflush(fp);
+}
+
+obj_t *prim_heap_dump(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) < 0 || length(args) > 1)
+    error("heap-dump: Wrong number of arguments");
+  if (length(args) == 0) {
+    heap_dump(stderr);
+    return TRUE;
+  }
+
+  obj_t *path = eval(env, args->car);
+  if (type_of(path) != T_STRING)
+    error("heap-dump: File name should be a string");
+  FILE *fp = fopen(path->name, "w");
+  if (fp == NULL)
+    error("heap-dump: Failed to open file");
+  heap_dump(fp);
+  fclose(fp);
+  return TRUE;
+}
@@ -0,0 +1,403 @@
+#include "mlisp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/*
+ * Server mode, `mlisp -s path`, evaluates requests sent over a Unix
+ * domain socket. `mlisp -c path` is a client for it.
+ *
+ * A request is a line of source. Its forms are evaluated in order and the
+ * reply is a line, "ok " and the printed value of the last form, or
+ * "error " and the message. A connection may send any number of requests.
+ *
+ * The environment is initialized once, with the files given with -l
+ * loaded, and every request starts from a snapshot of it: what a request
+ * defines is gone for the next one. A request fails once it has run for
+ * MLISP_SERVER_TIMEOUT_MS milliseconds or made MLISP_SERVER_MAX_ALLOCS
+ * allocations, or recurses too deep for the stack.
+ *
+ * Connections are multiplexed with epoll and their requests evaluated one
+ * at a time. With -w n, n worker processes forked from the initialized
+ * server accept connections from the same socket, and a worker that dies
+ * is replaced by a new one.
+ */
+
+#define SERVER_TIMEOUT_MS 5000
+#define STACK_RESERVE (256 * 1024)  /* left for error handling and the collector */
+#define SERVER_MAX_ALLOCS 10000000
+#define REQUEST_MAX (1 << 20)
+#define MAX_EVENTS 64
+#define RESPAWN_DELAY_US 100000     /* between restarts of a worker dying at once */
+
+typedef struct client_t {
+  int fd;
+  char *in;                     /* received, not yet evaluated */
+  size_t in_len;
+  size_t in_cap;
+  char *out;                    /* replies not yet sent */
+  size_t out_len;
+  size_t out_cap;
+  int closing;                  /* close once out is sent */
+} client_t;
+
+static obj_t *env;
+static snapshot_t snap;
+static long timeout_ms;
+static size_t max_allocs;
+static int epfd;
+static int listen_fd;
+static volatile sig_atomic_t stopping;
+
+static size_t env_size(char *name, size_t def)
+{
+  char *val = getenv(name);
+  return (val && val[0]) ? strtoul(val, NULL, 10) : def;
+}
+
+static void on_alarm(int sig)
+{
+  eval_timeout = 1;
+}
+
+static void on_stop(int sig)
+{
+  stopping = 1;
+}
+
+static void set_timer(long ms)
+{
+  struct itimerval it = { { 0, 0 }, { ms / 1000, ms % 1000 * 1000 } };
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
+static void append(char **buf, size_t *len, size_t *cap, const char *s, size_t n)
+{
+  if (*len + n > *cap) {
+    while (*len + n > *cap)
+      *cap = *cap ? *cap * 2 : 4096;
+    *buf = realloc(*buf, *cap);
+    if (*buf == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  memcpy(*buf + *len, s, n);
+  *len += n;
+}
+
+static void reply(client_t *c, const char *status, const char *body)
+{
+  append(&c->out, &c->out_len, &c->out_cap, status, strlen(status));
+  append(&c->out, &c->out_len, &c->out_cap, " ", 1);
+  append(&c->out, &c->out_len, &c->out_cap, body, strlen(body));
+  append(&c->out, &c->out_len, &c->out_cap, "\n", 1);
+}
+
+/* evaluate one request from the snapshot, within the limits */
+static void handle(client_t *c, char *src, size_t len)
+{
+  jmp_buf jb;
+  print_opt_t opt = default_print_opt();
+  opt.compact = 1;
+
+  env = restore_snapshot(&snap);
+  eval_timeout = 0;
+  error_handler = &jb;
+  if (setjmp(jb) == 0) {
+    set_timer(timeout_ms);
+    gc_set_alloc_limit(max_allocs);
+    obj_t *ret = eval_string(&env, src, len);
+    set_timer(0);
+    gc_set_alloc_limit(0);
+
+    char *s = sprint_obj(ret, &opt);
+    reply(c, "ok", s);
+    free(s);
+  } else {
+    set_timer(0);
+    gc_set_alloc_limit(0);
+    reply(c, "error", error_message);
+  }
+  error_handler = NULL;
+  eval_timeout = 0;
+
+  reset_evaluation();
+}
+
+static void watch(client_t *c, int op)
+{
+  struct epoll_event ev = { EPOLLIN | (c->out_len ? EPOLLOUT : 0), { .ptr = c } };
+  epoll_ctl(epfd, op, c->fd, &ev);
+}
+
+static void drop(client_t *c)
+{
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+/* returns 0 if the client is gone */
+static int flush_out(client_t *c)
+{
+  while (c->out_len > 0) {
+    ssize_t n = write(c->fd, c->out, c->out_len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0)
+      return 0;
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+  }
+  return !(c->closing && c->out_len == 0);
+}
+
+/* returns 0 if the client is gone */
+static int read_in(client_t *c)
+{
+  for (;;) {
+    char buf[4096];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      /* a last request without a newline still gets its reply */
+      if (c->in_len > 0)
+        handle(c, c->in, c->in_len);
+      c->in_len = 0;
+      c->closing = 1;
+      break;
+    }
+    append(&c->in, &c->in_len, &c->in_cap, buf, n);
+  }
+
+  char *start = c->in, *end = c->in + c->in_len, *nl;
+  while (start < end && (nl = memchr(start, '\n', end - start)) != NULL) {
+    handle(c, start, nl - start);
+    start = nl + 1;
+  }
+  c->in_len = end - start;
+  memmove(c->in, start, c->in_len);
+
+  if (c->in_len > REQUEST_MAX) {
+    reply(c, "error", "Request too long");
+    c->in_len = 0;
+    c->closing = 1;
+  }
+  return flush_out(c);
+}
+
+static void accept_clients()
+{
+  int fd;
+  while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+    client_t *c = calloc(1, sizeof(client_t));
+    if (c == NULL) {
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->fd = fd;
+    watch(c, EPOLL_CTL_ADD);
+  }
+}
+
+static void serve()
+{
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = { EPOLLIN, { .ptr = NULL } };
+  if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+    perror("epoll");
+    exit(1);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (!stopping) {
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+    for (int i = 0; i < n; i++) {
+      client_t *c = events[i].data.ptr;
+      if (c == NULL) {
+        accept_clients();
+        continue;
+      }
+
+      int alive = 1;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        alive = read_in(c);
+      else if (events[i].events & EPOLLOUT)
+        alive = flush_out(c);
+
+      if (alive)
+        watch(c, EPOLL_CTL_MOD);
+      else
+        drop(c);
+    }
+  }
+  close(epfd);
+}
+
+static void preload(char **files, int nfiles)
+{
+  jmp_buf jb;
+  for (int i = 0; i < nfiles; i++) {
+    error_handler = &jb;
+    if (setjmp(jb) != 0) {
+      fprintf(stderr, "%s: %s\n", files[i], error_message);
+      exit(1);
+    }
+    load_file(files[i]);
+  }
+  error_handler = NULL;
+}
+
+static pid_t spawn_worker(time_t *started)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    serve();
+    _exit(0);
+  }
+  if (pid < 0)
+    perror("fork");
+  *started = time(NULL);
+  return pid;
+}
+
+int run_server(char *path, int workers, char **files, int nfiles)
+{
+  timeout_ms = env_size("MLISP_SERVER_TIMEOUT_MS", SERVER_TIMEOUT_MS);
+  max_allocs = env_size("MLISP_SERVER_MAX_ALLOCS", SERVER_MAX_ALLOCS);
+
+  /* stop runaway recursion with an error instead of a crash */
+  struct rlimit rl;
+  size_t stack = 8 << 20;
+  if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+    stack = rl.rlim_cur;
+  stack_limit = (char *)gc_stack_top() - stack + STACK_RESERVE;
+
+  initialize(&env);
+  preload(files, nfiles);
+  save_snapshot(&snap, env);
+
+  struct sockaddr_un addr = { AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: Socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 128) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  struct sigaction sa = { 0 };
+  sa.sa_handler = on_alarm;
+  sigaction(SIGALRM, &sa, NULL);
+  sa.sa_handler = on_stop;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (workers <= 1) {
+    serve();
+  } else {
+    /* the workers share the initialized heap copy-on-write */
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    time_t *started = calloc(workers, sizeof(time_t));
+    for (int i = 0; i < workers; i++)
+      pids[i] = spawn_worker(&started[i]);
+
+    while (!stopping) {
+      int status;
+      pid_t pid = wait(&status);
+      if (pid < 0 && errno == EINTR)
+        continue;
+      if (pid < 0)
+        break;
+
+      int i = 0;
+      while (i < workers && pids[i] != pid)
+        i++;
+      if (i == workers || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+        if (i < workers)
+          pids[i] = -1;
+        continue;
+      }
+      if (WIFSIGNALED(status))
+        fprintf(stderr, "worker %d killed by signal %d, restarting\n", (int)pid, WTERMSIG(status));
+      else
+        fprintf(stderr, "worker %d exited with %d, restarting\n", (int)pid, WEXITSTATUS(status));
+      /* don't spin on a worker that dies as soon as it starts */
+      if (time(NULL) - started[i] < 1)
+        usleep(RESPAWN_DELAY_US);
+      pids[i] = stopping ? -1 : spawn_worker(&started[i]);
+    }
+    for (int i = 0; i < workers; i++) {
+      if (pids[i] > 0)
+        kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0)
+      ;
+    free(pids);
+    free(started);
+  }
+
+  close(listen_fd);
+  unlink(path);
+  return 0;
+}
+
+/* `mlisp -c path` sends each line of stdin as a request and prints the replies */
+int run_client(char *path)
+{
+  struct sockaddr_un addr = { AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: Socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  FILE *in = fdopen(fd, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int failed = 0;
+  while ((len = getline(&line, &cap, stdin)) > 0) {
+    if (line[len - 1] != '\n')
+      line[len++] = '\n';      /* getline leaves room for the terminator */
+    if (write(fd, line, len) != len || (len = getline(&line, &cap, in)) <= 0) {
+      fprintf(stderr, "%s: Connection lost\n", path);
+      failed = 1;
+      break;
+    }
+    fwrite(line, 1, len, stdout);
+    fflush(stdout);
+  }
+
+  free(line);
+  fclose(in);
+  return failed;
+}
@@ -0,0 +1,361 @@
+#include "mlisp.h"
+
+/*
+ * Promises and lazy streams.
+ *
+ * (delay expr...) returns a promise to evaluate the exprs, in the
+ * environment of the delay, the first time it is forced. (force p)
+ * evaluates them once and returns the value ever after. Forcing anything
+ * that isn't a promise returns it as it is. Forcing a promise while it is
+ * being forced, from its own exprs or another coroutine, is an error.
+ *
+ * A stream is nil, a cell of its first element and a promise of the rest,
+ * as made by (cons-stream a b), or a promise of a stream. The stream
+ * functions force no more of their input than is asked of their output,
+ * so a pipeline folding over a stream keeps a few elements alive at a
+ * time, not the whole input:
+ *
+ *   (stream-fold + 0 (stream-filter evenp (stream-map sq (read-stream "in.l"))))
+ *
+ * A promise keeps its thunk until it is forced, then only the value. The
+ * thunk is a function of no arguments, or for the streams made here a
+ * (step . vals) cell: a C function and the values to call it with.
+ */
+
+/* an offset in a file, stored in two ints */
+#define OFFSET_SHIFT 30
+
+static FILE *reader;            /* file read-stream read from last */
+static char *reader_path;
+
+static obj_t *new_promise(obj_t **env, obj_t *thunk)
+{
+  obj_t *obj = allocate(env, T_PROMISE);
+  obj->car = NIL;
+  obj->cdr = thunk;
+  gc_write_barrier(obj, thunk);
+  return obj;
+}
+
+/* a promise to call step with vals */
+static obj_t *lazy(obj_t **env, primitive_t *step, obj_t *vals)
+{
+  return new_promise(env, new_cell(env, new_primitive(env, step), vals));
+}
+
+obj_t *force(obj_t **env, obj_t *obj)
+{
+  if (type_of(obj) != T_PROMISE)
+    return obj;
+  if (obj->cdr == NULL)
+    return obj->car;
+  if (obj->cdr == TRUE)
+    error("force: Promise is already being forced");
+
+  /*
+   * The thunk is replaced by t while it runs, so that forcing the promise
+   * again from the thunk, or from another coroutine, fails rather than
+   * seeing a half-made value. It is put back if the thunk fails.
+   */
+  obj_t *thunk = obj->cdr, *val;
+  obj->cdr = TRUE;
+  jmp_buf jb, *prev = error_handler;
+  error_handler = &jb;
+  if (setjmp(jb) != 0) {
+    error_handler = prev;
+    obj->cdr = thunk;
+    gc_write_barrier(obj, thunk);
+    error(error_message);
+  }
+  if (type_of(thunk) == T_FUNCTION) {
+    obj_t *e = thunk->captured;
+    val = prim_progn(&e, thunk->body);
+  } else {
+    val = thunk->car->fn(env, thunk->cdr);
+  }
+  error_handler = prev;
+
+  obj->car = val;
+  obj->cdr = NULL;
+  gc_write_barrier(obj, val);
+  return val;
+}
+
+static obj_t *quote_all(obj_t **env, obj_t *quote, obj_t *vals)
+{
+  if (type_of(vals) != T_CELL)
+    return NIL;
+  obj_t *rest = quote_all(env, quote, vals->cdr);
+  obj_t *arg = new_cell(env, quote, new_cell(env, vals->car, NIL));
+  return new_cell(env, arg, rest);
+}
+
+/* call fn, a function or a primitive, with evaluated arguments */
+static obj_t *call(obj_t **env, obj_t *fn, obj_t *vals)
+{
+  if (type_of(fn) == T_FUNCTION)
+    return fn->memo ? memo_call(env, fn, vals) : call_function(env, fn, vals);
+
+  /* primitives evaluate their arguments themselves */
+  return fn->fn(env, quote_all(env, intern(env, "quote"), vals));
+}
+
+static obj_t *fn_arg(obj_t **env, obj_t *arg, char *msg)
+{
+  obj_t *fn = eval(env, arg);
+  if (type_of(fn) != T_FUNCTION && type_of(fn) != T_PRIMITIVE)
+    error(msg);
+  return fn;
+}
+
+/* the stream s as nil or a cell */
+static obj_t *stream_arg(obj_t **env, obj_t *s, char *msg)
+{
+  s = force(env, s);
+  if (type_of(s) != T_CELL && type_of(s) != T_NIL)
+    error(msg);
+  return s;
+}
+
+static obj_t *list2(obj_t **env, obj_t *a, obj_t *b)
+{
+  return new_cell(env, a, new_cell(env, b, NIL));
+}
+
+obj_t *prim_delay(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) < 1)
+    error("delay: Wrong number of arguments");
+
+  return new_promise(env, new_function(env, NIL, args));
+}
+
+obj_t *prim_force(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("force: Wrong number of arguments");
+
+  return force(env, eval(env, args->car));
+}
+
+obj_t *prim_cons_stream(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 2)
+    error("cons-stream: Wrong number of arguments");
+
+  obj_t *head = eval(env, args->car);
+  return new_cell(env, head, new_promise(env, new_function(env, NIL, args->cdr)));
+}
+
+obj_t *prim_stream_car(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("stream-car: Wrong number of arguments");
+
+  obj_t *s = stream_arg(env, eval(env, args->car), "stream-car: Not a stream");
+  if (type_of(s) != T_CELL)
+    error("stream-car: Empty stream");
+  return s->car;
+}
+
+obj_t *prim_stream_cdr(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("stream-cdr: Wrong number of arguments");
+
+  obj_t *s = stream_arg(env, eval(env, args->car), "stream-cdr: Not a stream");
+  if (type_of(s) != T_CELL)
+    error("stream-cdr: Empty stream");
+  return force(env, s->cdr);
+}
+
+/* vals is (fn s) */
+static obj_t *map_step(obj_t **env, obj_t *vals)
+{
+  obj_t *fn = vals->car;
+  obj_t *s = stream_arg(env, vals->cdr->car, "stream-map: Not a stream");
+  if (type_of(s) != T_CELL)
+    return NIL;
+
+  obj_t *head = call(env, fn, new_cell(env, s->car, NIL));
+  return new_cell(env, head, lazy(env, map_step, list2(env, fn, s->cdr)));
+}
+
+obj_t *prim_stream_map(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 2)
+    error("stream-map: Wrong number of arguments");
+
+  obj_t *fn = fn_arg(env, args->car, "stream-map: Not a function");
+  return map_step(env, list2(env, fn, eval(env, args->cdr->car)));
+}
+
+/* vals is (fn s) */
+static obj_t *filter_step(obj_t **env, obj_t *vals)
+{
+  obj_t *fn = vals->car;
+  obj_t *s;
+
+  /*
+   * Skip what is filtered out without keeping it: vals is moved along to
+   * the rest of the stream, or the promise being forced would hold on to
+   * every element skipped. A predicate failing leaves it at that element.
+   */
+  for (;;) {
+    s = stream_arg(env, vals->cdr->car, "stream-filter: Not a stream");
+    if (type_of(s) != T_CELL)
+      return NIL;
+    vals->cdr->car = s;
+    gc_write_barrier(vals->cdr, s);
+    if (type_of(call(env, fn, new_cell(env, s->car, NIL))) != T_NIL)
+      break;
+    vals->cdr->car = s->cdr;
+    gc_write_barrier(vals->cdr, s->cdr);
+  }
+
+  return new_cell(env, s->car, lazy(env, filter_step, list2(env, fn, s->cdr)));
+}
+
+obj_t *prim_stream_filter(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 2)
+    error("stream-filter: Wrong number of arguments");
+
+  obj_t *fn = fn_arg(env, args->car, "stream-filter: Not a function");
+  return filter_step(env, list2(env, fn, eval(env, args->cdr->car)));
+}
+
+/* vals is (n s) */
+static obj_t *take_step(obj_t **env, obj_t *vals)
+{
+  int n = vals->car->value;
+  if (n <= 0)
+    return NIL;
+
+  obj_t *s = stream_arg(env, vals->cdr->car, "stream-take: Not a stream");
+  if (type_of(s) != T_CELL)
+    return NIL;
+  return new_cell(env, s->car, lazy(env, take_step, list2(env, new_int(env, n - 1), s->cdr)));
+}
+
+obj_t *prim_stream_take(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 2)
+    error("stream-take: Wrong number of arguments");
+
+  obj_t *n = eval(env, args->car);
+  if (type_of(n) != T_INT)
+    error("stream-take: Count should be an int");
+  return take_step(env, list2(env, n, eval(env, args->cdr->car)));
+}
+
+obj_t *prim_stream_fold(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 3)
+    error("stream-fold: Wrong number of arguments");
+
+  obj_t *fn = fn_arg(env, args->car, "stream-fold: Not a function");
+  obj_t *acc = eval(env, args->cdr->car);
+  obj_t *s = eval(env, args->cdr->cdr->car);
+
+  for (;;) {
+    s = stream_arg(env, s, "stream-fold: Not a stream");
+    if (type_of(s) != T_CELL)
+      return acc;
+    acc = call(env, fn, list2(env, acc, s->car));
+    s = s->cdr;
+  }
+}
+
+obj_t *prim_stream_to_list(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("stream->list: Wrong number of arguments");
+
+  obj_t *s = eval(env, args->car);
+  obj_t *head = NIL, *tail = NIL;
+  for (;;) {
+    s = stream_arg(env, s, "stream->list: Not a stream");
+    if (type_of(s) != T_CELL)
+      return head;
+
+    obj_t *cell = new_cell(env, s->car, NIL);
+    if (type_of(tail) == T_NIL) {
+      head = cell;
+    } else {
+      tail->cdr = cell;
+      gc_write_barrier(tail, cell);
+    }
+    tail = cell;
+    s = s->cdr;
+  }
+}
+
+/* close the file read-stream reads from */
+void stream_reset()
+{
+  if (reader != NULL)
+    fclose(reader);
+  reader = NULL;
+  free(reader_path);
+  reader_path = NULL;
+}
+
+/* vals is (path offset-high offset-low) */
+static obj_t *read_step(obj_t **env, obj_t *vals)
+{
+  char *path = vals->car->name;
+  long offset = ((long)vals->cdr->car->value << OFFSET_SHIFT) | vals->cdr->cdr->car->value;
+
+  /* reading a stream in order continues where the last form ended */
+  if (reader == NULL || strcmp(reader_path, path) != 0 || ftell(reader) != offset) {
+    stream_reset();
+    if ((reader = fopen(path, "r")) == NULL)
+      error("read-stream: Failed to open file");
+    reader_path = strdup(path);
+    if (fseek(reader, offset, SEEK_SET) != 0) {
+      stream_reset();
+      error("read-stream: Failed to read file");
+    }
+  }
+
+  /* put the reader back before passing errors on */
+  FILE *prev = set_parse_input(reader);
+  jmp_buf jb, *prev_handler = error_handler;
+  error_handler = &jb;
+  if (setjmp(jb) != 0) {
+    error_handler = prev_handler;
+    set_parse_input(prev);
+    stream_reset();
+    error(error_message);
+  }
+  node_t *node = parse();
+  error_handler = prev_handler;
+  set_parse_input(prev);
+
+  if (node == NULL) {
+    stream_reset();
+    return NIL;
+  }
+  obj_t *form = allocation(env, node);
+  destory_ast(node);
+
+  offset = ftell(reader);
+  obj_t *next = new_cell(env, vals->car,
+                         list2(env, new_int(env, offset >> OFFSET_SHIFT),
+                               new_int(env, offset & ((1L << OFFSET_SHIFT) - 1))));
+  return new_cell(env, form, lazy(env, read_step, next));
+}
+
+obj_t *prim_read_stream(struct obj_t **env, struct obj_t *args)
+{
+  if (length(args) != 1)
+    error("read-stream: Wrong number of arguments");
+
+  obj_t *path = eval(env, args->car);
+  if (type_of(path) != T_STRING)
+    error("read-stream: File name should be a string");
+
+  obj_t *zero = new_int(env, 0);
+  return lazy(env, read_step, new_cell(env, path, list2(env, zero, zero)));
+}
@@ -33,6 +33,16 @@ eval_run() {
     MLISP_EVAL_TEST=1 run "$@"
 }
 
+batch_run() {
+    echo -n "- Testing $1 ... "
+    result=$(printf "$2" | ./mlisp -b - 2> /dev/null | tail -n 1)
+    if [ "$result" != "$3" ]; then
+        echo FAILED
+        fail "$3 expected, but got $result"
+    fi
+    echo "$result"
+}
+
 echo -e "\n== Parse test =="
 
 parse_run int "1" "1"
@@ -136,3 +146,391 @@ eval_run let_labmda2 '(let ((v (+ 1 20)) (f (lambda (x) (+ x 10)))) (f v))' 31
 eval_run closure '(let ((c 10)) (let ((f (lambda (x) (+ c x)))) (f 10)))' 20
 eval_run closure2 '(let ((c 10)) (let ((f (lambda (x) (+ x c)))) (let ((a (lambda (y) (f y)))) (a 20))))' 30
 eval_run lambda_with_lambda '((lambda (f1 f2) (f2 (f1 10) (f1 20))) (lambda (x) x) (lambda (x y) (* x y)))' 200
+eval_run list_arg "((lambda (x) (car x)) '(1 2))" 1
+eval_run lexical '(progn (define x 1) (defun getx () x) (let ((x 2)) (getx)))' 1
+eval_run make_adder '(progn (defun make-adder (n) (lambda (x) (+ x n))) ((make-adder 10) 5))' 15
+eval_run local_defun '(progn (defun outer (n) (progn (defun inner (k) (if (= k 0) 0 (+ 1 (inner (- k 1))))) (inner n))) (outer 5))' 5
+eval_run closure_shadow '(let ((a 1) (b 2)) (let ((f (lambda (x) (let ((a 10)) (+ a b x))))) (f 100)))' 112
+eval_run closure_macro "(progn (defmacro addb (x) (list '+ x 'b)) (let ((b 5)) ((lambda (y) (addb y)) 1)))" 6
+eval_run closure_macro_redefined "(progn (defmacro foo (a) 1) (defun make (x) (lambda () (foo x))) ((make 5)) (defun foo (a) a) ((make 7)))" 7
+eval_run closure_macro_defined "(progn (defun foo (a) a) (defun make (y) (lambda () (foo 1))) ((make 5)) (defmacro foo (a) 'y) ((make 7)))" 7
+
+echo -e "\n== Loop test =="
+
+allocs_of() {
+    echo "$1" | MLISP_STATS=1 ./mlisp 2>&1 > /dev/null | tr ' ' '\n' | sed -n 's/^allocs=//p'
+}
+
+eval_run setq '(progn (define x 1) (setq x 5) x)' 5
+eval_run set! "(let ((x 1)) (progn (set! x (+ x 1)) x))" 2
+eval_run setq_closure '(let ((n 0)) (let ((inc (lambda () (setq n (+ n 1))))) (progn (inc) (inc) n)))' 2
+eval_run while '(let ((s 0) (i 0)) (progn (while (< i 10) (setq s (+ s i)) (setq i (+ i 1))) s))' 45
+eval_run dotimes '(let ((s 0)) (dotimes (i 5 s) (setq s (+ s i))))' 10
+eval_run dotimes_result '(dotimes (i 3 i) 1)' 3
+eval_run dolist "(let ((s 0)) (dolist (x '(1 2 3) s) (setq s (+ s x))))" 6
+eval_run loop_in_defun '(progn (defun count (n) (let ((c 0)) (progn (dotimes (i n) (setq c (+ c 1))) c))) (count 100000))' 100000
+
+echo -n "- Testing loop_alloc ... "
+few=$(allocs_of '(let ((c 0)) (dotimes (i 10) (setq c (+ c i))))')
+many=$(allocs_of '(let ((c 0)) (dotimes (i 1000) (setq c (+ c 1))))')
+[ "$few" = "$many" ] || fail "$few allocations for 10 iterations, but $many for 1000"
+echo "$many"
+echo -n "- Testing loop_alloc_large ... "
+shared=$(allocs_of '(dotimes (i 3000) 1)')
+large=$(allocs_of '(dotimes (i 5000) 1)')
+# counters past the shared ints take one int per iteration
+[ $((large - shared)) = 2000 ] || fail "$((large - shared)) allocations for 2000 iterations past the shared ints"
+echo "$((large - shared))"
+
+echo -e "\n== JIT test =="
+
+fib="(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+tak="(defun tak (x y z) (if (< y x) (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)) z))"
+
+MLISP_JIT_THRESHOLD=1 eval_run jit_fib "(progn $fib (fib 20))" 6765
+MLISP_JIT_THRESHOLD=1 eval_run jit_tak "(progn $tak (tak 18 12 6))" 7
+MLISP_NO_JIT=1 eval_run no_jit "(progn $fib (fib 10))" 55
+MLISP_JIT_THRESHOLD=1 eval_run jit_params '(progn (defun g (a b c d e f) (if (= a 0) (* b c d e f) (g (- a 1) (+ b 1) c d e (- f 1)))) (g 5 1 2 3 4 5))' 0
+MLISP_JIT_THRESHOLD=1 eval_run jit_compare '(progn (defun lt (a b) (if (< a b) 1 0)) (+ (lt 1 2) (lt 2 2) (lt 3 2)))' 1
+MLISP_JIT_THRESHOLD=1 eval_run jit_redefine '(progn (defun f (x) (+ x 1)) (f 1) (define + -) (f 10))' 9
+MLISP_JIT_THRESHOLD=1 eval_run jit_non_int '(progn (defun id (x) x) (id 1) (id t))' t
+MLISP_JIT_THRESHOLD=1 eval_run jit_free_var '(progn (define k 5) (defun addk (x) (+ x k)) (addk 1) (addk 2))' 7
+
+echo -e "\n== Memo test =="
+
+iota="(defun iota (n) (if (= n 0) () (cons n (iota (- n 1)))))"
+churn="(defun churn (k) (if (= k 0) (progn (iota 200) 0) (+ (churn (- k 1)) (churn (- k 1)))))"
+mfib="(defun-memo fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+
+eval_run memo_fib "(progn $mfib (fib 40))" 102334155
+eval_run memo_stats "(progn $mfib (fib 40) (memo-stats fib))" "(38 41 41)"
+MLISP_MEMO_SIZE=8 eval_run memo_lru "(progn $mfib (fib 30) (memo-stats fib))" "(28 31 8)"
+eval_run memo_structural "(progn (defun-memo f (l) (car l)) (f '(1 2)) (f (list 1 2)) (f '(1 3)) (memo-stats f))" "(1 2 2)"
+eval_run memo_list "(progn (defun-memo pair (n) (list n n)) (pair 3) (pair 3))" "(3 3)"
+eval_run memo_closure "(let ((k 10)) (progn (defun-memo addk (n) (+ n k)) (addk 1) (addk 1)))" 11
+MLISP_HEAP_SIZE=1048576 eval_run memo_gc "(progn $iota $churn (defun-memo pair (n) (list n n)) (pair 3) (churn 8) (car (pair 3)))" 3
+
+echo -e "\n== Load test =="
+
+stat_of() {
+    echo "$1" | MLISP_STATS=1 ./mlisp 2>&1 > /dev/null | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lib="$dir/lib.l"
+cat > "$lib" <<'EOS'
+(defmacro unless (c body) (list 'if c 0 body))
+(defun sq (x) (* x x))
+(define name "lib \"one\"")
+(defun sum-to (n) (unless (= n 0) (+ n (sum-to (- n 1)))))
+(define data '(a (b . 3) "s" 100000))
+EOS
+
+eval_run load "(progn (load \"$lib\") (list (sq 7) (sum-to 10) name data))" '(49 55 "lib \"one\"" (a (b . 3) "s" 100000))'
+echo -n "- Testing load_cache_written ... "
+[ -f "$lib.mlc" ] || fail "$lib.mlc not written"
+echo ok
+echo -n "- Testing load_cache_used ... "
+[ "$(stat_of "(load \"$lib\")" load_cached)" = 1 ] || fail "cache not used"
+echo ok
+eval_run load_cached "(progn (load \"$lib\") (list (sq 7) (sum-to 10) name data))" '(49 55 "lib \"one\"" (a (b . 3) "s" 100000))'
+sed -i 's/(\* x x)/(+ x x)/' "$lib"
+eval_run load_modified "(progn (load \"$lib\") (sq 7))" 14
+touch -d '2001-01-01' "$lib"
+echo -n "- Testing load_touched ... "
+[ "$(stat_of "(load \"$lib\")" load_cached)" = 1 ] || fail "cache not used"
+echo ok
+echo '(defmacro one () 1)' > "$dir/mac.l"
+printf '(load "%s")\n(define v (one))\n' "$dir/mac.l" > "$dir/use.l"
+eval_run load_macro "(progn (load \"$dir/use.l\") v)" 1
+echo '(defmacro one () 2)' > "$dir/mac.l"
+eval_run load_macro_changed "(progn (load \"$dir/use.l\") v)" 2
+eval_run load_macro_recached "(progn (load \"$dir/use.l\") v)" 2
+echo '(define broken (car 1))' > "$dir/bad.l"
+echo -n "- Testing load_error ... "
+echo "(load \"$dir/bad.l\")" | ./mlisp > /dev/null 2>&1 && fail "error expected"
+[ ! -f "$dir/bad.l.mlc" ] || fail "cache written for a failed load"
+echo ok
+
+echo -e "\n== Coroutine test =="
+
+stage="(defun stage (in out) (let ((v 0)) (progn (while (setq v (recv in)) (send out (car (list (+ v 1))))) (close out))))"
+chain="(defun chain (n in) (if (= n 0) in (let ((out (make-channel 1))) (progn (spawn stage in out) (chain (- n 1) out)))))"
+drain="(defun drain (ch) (let ((s 0) (v 0)) (progn (while (setq v (recv ch)) (setq s (+ s v))) s)))"
+worker="(defun worker (tag) (dotimes (i 3) (progn (setq log (cons (list tag i) log)) (yield))))"
+
+eval_run join "(join (spawn (lambda (a b) (+ a b)) 3 4))" 7
+eval_run channel "(let ((ch (make-channel))) (progn (spawn (lambda () (dotimes (i 5) (send ch i)))) (list (recv ch) (recv ch) (recv ch))))" "(0 1 2)"
+eval_run round_robin "(progn (define log ()) $worker (let ((a (spawn worker 1)) (b (spawn worker 2))) (progn (join a) (join b) log)))" "((2 2) (1 2) (2 1) (1 1) (2 0) (1 0))"
+eval_run bounded_close "(let ((ch (make-channel 2))) (progn $drain (spawn (lambda () (progn (dotimes (i 10) (send ch i)) (close ch)))) (drain ch)))" 45
+eval_run pipeline "(progn $stage $chain $drain (let ((src (make-channel 1))) (let ((sink (chain 1000 src))) (progn (spawn (lambda () (progn (dotimes (i 10) (send src i)) (close src)))) (drain sink)))))" 10045
+MLISP_HEAP_SIZE=1048576 eval_run pipeline_gc "(progn $stage $chain $drain (let ((src (make-channel 1))) (let ((sink (chain 50 src))) (progn (spawn (lambda () (progn (dotimes (i 300) (send src i)) (close src)))) (drain sink)))))" 59850
+echo -n "- Testing coroutine_error ... "
+echo "(join (spawn (lambda () (car 1))))" | ./mlisp > /dev/null 2>&1 && fail "error expected"
+echo ok
+echo -n "- Testing deadlock ... "
+echo "(recv (make-channel))" | ./mlisp 2>&1 | grep -q Deadlock || fail "deadlock not detected"
+echo ok
+
+mkfifo "$dir/fifo"
+(sleep 0.2; echo a; sleep 0.1; echo b) > "$dir/fifo" &
+echo -n "- Testing read_line ... "
+result=$(echo "(let ((ticks 0) (done ())) (progn (spawn (lambda () (while (if done () t) (progn (setq ticks (+ ticks 1)) (yield))))) (let ((lines (list (read-line 3) (read-line 3) (read-line 3)))) (progn (setq done t) (list lines (< 0 ticks))))))" | ./mlisp 3< "$dir/fifo" 2> /dev/null)
+[ "$result" = '(("a" "b" ()) t)' ] || fail "((\"a\" \"b\" ()) t) expected, but got $result"
+echo "$result"
+echo -n "- Testing read_line_flags ... "
+echo a > "$dir/line.txt"
+exec 5< "$dir/line.txt"
+echo "(read-line 5)" | ./mlisp > /dev/null
+flags=$(sed -n 's/^flags:\t*//p' /proc/$$/fdinfo/5)
+exec 5<&-
+[ $((0$flags & 04000)) = 0 ] || fail "fd left non-blocking"
+echo ok
+eval_run join_recycle "(progn (defun one () 1) (join (spawn one)) (list (spawn one) (spawn one)))" "(1 2)"
+eval_run unjoined_recycle "(progn (dotimes (i 20000) (progn (spawn (lambda () i)) (make-channel) (yield))) (list (< (spawn (lambda () 0)) 20000) (< (make-channel) 20000)))" "(t t)"
+eval_run dropped_channel "(let ((c (make-channel))) (progn (spawn (lambda () (send c 5))) (send (make-channel 1) (dotimes (i 20000) (list i))) (recv c)))" 5
+echo -n "- Testing unjoined_memory ... "
+rss=$(echo "(dotimes (i 50000) (progn (spawn (lambda () i)) (yield)))" | MLISP_STATS=1 ./mlisp 2>&1 > /dev/null | tr ' ' '\n' | sed -n 's/^maxrss_kb=//p')
+[ "$rss" -lt 30000 ] || fail "coroutines not freed, maxrss_kb=$rss"
+echo ok
+
+echo -e "\n== Stream test =="
+
+ints="(defun ints (k) (cons-stream k (ints (+ k 1))))"
+
+eval_run force "(let ((n 0)) (let ((p (delay (setq n (+ n 1)) (* 10 n)))) (list (force p) (force p) n (force 5))))" "(10 10 1 5)"
+eval_run stream_take "(progn $ints (stream->list (stream-take 3 (ints 1))))" "(1 2 3)"
+eval_run stream_pipeline "(progn $ints (stream->list (stream-take 4 (stream-map (lambda (x) (* x x)) (stream-filter (lambda (x) (< 3 x)) (ints 1))))))" "(16 25 36 49)"
+eval_run stream_fold "(progn $ints (stream-fold + 0 (stream-take 100 (ints 1))))" 5050
+eval_run stream_cdr "(progn $ints (stream-car (stream-cdr (ints 7))))" 8
+echo -n "- Testing force_reentrant ... "
+echo "(progn (define p (delay (force p))) (force p))" | ./mlisp 2>&1 | grep -q "already being forced" || fail "error expected"
+echo ok
+eval_run stream_filter_retry "(progn $ints (define boom t) (define s (stream-filter (lambda (x) (if (= x 5) (if boom (progn (setq boom ()) (car 1)) ()) (if (= x 1) t (< 6 x)))) (ints 1))) (spawn (lambda () (stream-cdr s))) (yield) (stream->list (stream-take 3 s)))" "(1 7 8)"
+eval_run stream_filter_shared "(progn $ints (define s (stream-filter (lambda (x) (progn (yield) (< 3 x))) (ints 4))) (let ((a (spawn (lambda () (stream-car (stream-cdr s))))) (b (spawn (lambda () (stream-car (stream-cdr s)))))) (list (join a) (stream-car (stream-cdr s)))))" "(5 5)"
+
+printf '(a 1)\n"str" 42 (b\n 2) sym\n' > "$dir/forms.l"
+eval_run read_stream "(stream->list (read-stream \"$dir/forms.l\"))" '((a 1) "str" 42 (b 2) sym)'
+seq 1 100000 | sed 's/.*/(&)/' > "$dir/big.l"
+MLISP_HEAP_SIZE=1048576 eval_run stream_constant_memory "(stream-fold (lambda (acc x) (+ acc (car x))) 0 (stream-filter (lambda (x) (< 99000 (car x))) (read-stream \"$dir/big.l\")))" 99500500
+echo -n "- Testing read_stream_error ... "
+printf '(a 1) (b' > "$dir/bad.l"
+echo "(stream->list (read-stream \"$dir/bad.l\"))" | ./mlisp > /dev/null 2>&1 && fail "error expected"
+echo ok
+
+echo -e "\n== Heap profile test =="
+
+build="(defun build (n acc) (if (= n 0) acc (build (- n 1) (cons (list n n) acc))))"
+heap_prog="(progn $build (define cache (build 500 ())) (define shared (list 9 9 9)) (define a shared) (define b shared) (define old (list 1 2)) (define old 3) (heap-dump \"$dir/heap.txt\"))"
+
+heap_has() {
+    echo -n "- Testing $1 ... "
+    grep -Eq "$2" "$dir/heap.txt" || fail "/$2/ expected in $(cat "$dir/heap.txt")"
+    echo ok
+}
+
+heap_lacks() {
+    echo -n "- Testing $1 ... "
+    grep -Eq "$2" "$dir/heap.txt" && fail "/$2/ unexpected in $(cat "$dir/heap.txt")"
+    echo ok
+}
+
+echo "$heap_prog" | ./mlisp > /dev/null 2>&1 || fail "heap-dump failed"
+heap_has heap_types "^cell +[0-9]+ +[0-9]+$"
+heap_has heap_retained "^cache +24000$"
+heap_has heap_shadowed "^old \(shadowed\) +32$"
+heap_lacks heap_shared "^(a|b|shared) "
+heap_lacks heap_no_sites "^build/"
+
+echo "$heap_prog" | MLISP_HEAP_PROFILE=1 ./mlisp > /dev/null 2> "$dir/exit.txt" || fail "heap-dump failed"
+heap_has heap_sites "^build/list +cell +1000 +16000$"
+heap_has heap_site_cons "^build/cons +cell +500 +8000$"
+echo -n "- Testing heap_exit ... "
+grep -q "^heap: " "$dir/exit.txt" || fail "census at exit expected"
+echo ok
+
+echo -e "\n== Embed test =="
+
+cat > "$dir/host.c" <<'EOS'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libmlisp.h"
+
+int error, eval, length;        /* the interpreter's own names stay out of the host's way */
+
+static obj_t *twice(obj_t **env, obj_t *args)
+{
+  obj_t *v = mlisp_eval_arg(env, mlisp_car(args));
+  if (!mlisp_is_int(v))
+    mlisp_raise("twice: Not an int");
+  return mlisp_make_int(env, mlisp_int_value(v) * 2);
+}
+
+static void show(mlisp_t *m, const char *src)
+{
+  obj_t *ret;
+  if (mlisp_eval(m, src, strlen(src), &ret) != MLISP_OK) {
+    printf("error: %s\n", mlisp_error(m));
+    return;
+  }
+  char *s = mlisp_print(ret);
+  printf("%s\n", s);
+  free(s);
+}
+
+int main()
+{
+  for (int round = 0; round < 2; round++) {
+    mlisp_t *m = mlisp_create();
+    if (m == NULL || mlisp_create() != NULL)
+      return 1;
+    mlisp_define_primitive(m, "twice", twice);
+    show(m, "(defun f (x) (twice x)) (f 21)");
+    show(m, "(twice 'a)");
+    show(m, "(car 1)");
+    show(m, "(f (f 1))");
+    show(m, "(car (");
+    show(m, "(defun deep (n) (+ 1 (deep n))) (deep 1)");
+    show(m, "(let)");
+
+    obj_t *keep = NULL;
+    mlisp_protect(m, &keep);
+    mlisp_eval(m, "(list 1 'sym \"str\")", 19, &keep);
+    for (int i = 0; i < 3000; i++)
+      mlisp_eval(m, "(list 1 2 3 4 5 6 7 8)", 22, NULL);
+    printf("%d %d %s %s\n", mlisp_length(keep), mlisp_int_value(mlisp_car(keep)),
+           mlisp_symbol_name(mlisp_car(mlisp_cdr(keep))),
+           mlisp_string_value(mlisp_car(mlisp_cdr(mlisp_cdr(keep)))));
+    mlisp_unprotect(m, &keep);
+    mlisp_destroy(m);
+  }
+  return 0;
+}
+EOS
+expected="42
+error: twice: Not an int
+error: Wrong type argument
+4
+error: Paren is Unmatch
+error: Stack overflow
+error: let: Wrong number of arguments
+3 1 sym str"
+expected="$expected
+$expected"
+
+echo -n "- Testing embed_static ... "
+cc -I. -o "$dir/host" "$dir/host.c" libmlisp.a || fail "failed to build against libmlisp.a"
+result=$("$dir/host")
+[ "$result" = "$expected" ] || fail "$expected expected, but got $result"
+echo ok
+echo -n "- Testing embed_shared ... "
+cc -I. -o "$dir/host" "$dir/host.c" -L. -lmlisp || fail "failed to build against libmlisp.so"
+result=$(LD_LIBRARY_PATH=. "$dir/host")
+[ "$result" = "$expected" ] || fail "$expected expected, but got $result"
+echo ok
+
+echo -e "\n== Server test =="
+
+wait_socket() {
+    for i in $(seq 100); do
+        [ -S "$1" ] && return 0
+        sleep 0.05
+    done
+    fail "server didn't start"
+}
+
+server_run() {
+    echo -n "- Testing $1 ... "
+    result=$(printf "$2" | timeout 10 ./mlisp -c "$sock" 2> /dev/null)
+    if [ "$result" != "$(printf "$3")" ]; then
+        echo FAILED
+        fail "$3 expected, but got $result"
+    fi
+    echo ok
+}
+
+workers_of() {
+    cat /proc/$1/task/*/children 2> /dev/null
+}
+
+sock="$dir/mlisp.sock"
+echo '(defun sq (x) (* x x)) (define base 100)' > "$dir/preload.l"
+# don't leave a server behind when a test fails
+trap 'kill $server 2> /dev/null; rm -rf "$dir"' EXIT
+MLISP_SERVER_TIMEOUT_MS=300 MLISP_SERVER_MAX_ALLOCS=100000 ./mlisp -s "$sock" -l "$dir/preload.l" &
+server=$!
+wait_socket "$sock"
+
+server_run server_eval "(sq 12)\n(+ base 1)\n\"s\" (list 1 'a)\n" "ok 144\nok 101\nok (1 a)"
+server_run server_reset "(define y 5)\ny\n" "ok 5\nerror Unkonw symbol"
+server_run server_reset_setq "(setq base 5)\nbase\n(setq car 1)\n(car '(1 2))\n" "ok 5\nok 100\nok 1\nok 1"
+server_run server_malformed "(dotimes)\n(car)\n(/)\n(let)\n(define 1 2)\n(lambda 1 2)\n(+ 1 . 2)\n(sq 3)\n" \
+    "error dotimes: Wrong number of arguments\nerror car: Wrong number of arguments\nerror /: Wrong number of arguments\nerror let: Wrong number of arguments\nerror define: Variable should be a symbol\nerror Parameters should be a list\nok 1\nok 9"
+server_run server_error "(car 1)\n(car (\n(sq 3)\n" "error Wrong type argument\nerror Paren is Unmatch\nok 9"
+server_run server_timeout "(while t 1)\n(sq 2)\n" "error Time limit exceeded\nok 4"
+server_run server_jit_timeout "(progn (defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 6) (fib 40))\n(sq 2)\n" "error Time limit exceeded\nok 4"
+server_run server_allocs "(dotimes (i 100000) (list i i))\n" "error Allocation limit exceeded"
+server_run server_stack "(progn (defun deep (n) (+ 1 (deep n))) (deep 1))\n(sq 5)\n" "error Stack overflow\nok 25"
+server_run server_stack_nested "(progn (defun nest (x) (+ x (* 2 (+ x (nest (- x 1)))))) (nest 1))\n(sq 5)\n" "error Stack overflow\nok 25"
+sleep 2 | ./mlisp -c "$sock" &
+idle=$!
+server_run server_concurrent "(sq 7)\n" "ok 49"
+kill $idle $server 2> /dev/null
+wait $server
+
+./mlisp -s "$sock" -w 2 -l "$dir/preload.l" 2> "$dir/server.log" &
+server=$!
+wait_socket "$sock"
+server_run server_workers "(sq 6)\n" "ok 36"
+kill -KILL $(workers_of $server)
+server_run server_respawn "(sq 6)\n(sq 7)\n" "ok 36\nok 49"
+grep -q "killed by signal 9, restarting" "$dir/server.log" || fail "worker restart not logged"
+kill $server
+wait $server
+trap 'rm -rf "$dir"' EXIT
+
+echo -e "\n== Print test =="
+
+eval_run dotted "'(1 2 . 3)" "(1 2 . 3)"
+eval_run nested "'(1 (2 (3 (4))) 5)" "(1 (2 (3 (4))) 5)"
+MLISP_PRINT_LENGTH=2 eval_run print_length "'(1 2 3 4)" "(1 2 ...)"
+MLISP_PRINT_DEPTH=2 eval_run print_depth "'(1 (2 (3 (4))))" "(1 (2 #))"
+MLISP_PRINT_COMPACT=1 eval_run print_compact "(list 'a ''b car)" "(a 'b #<primitive>)"
+MLISP_PRINT_DEPTH=2 parse_run print_depth "(1 (2 (3)))" "(1 (2 #))"
+
+echo -e "\n== Stress test =="
+
+ones=$(yes 1 | head -n 1000000 | tr '\n' ' ')
+million=$(seq 1 1000000 | tr '\n' ' ')
+MLISP_PRINT_LENGTH=3 parse_run "million parse" "'($million)" "(quote (1 2 3 ...))"
+eval_run "million args" "(+ $ones)" 1000000
+eval_run "million list" "(car (cdr (list $million)))" 2
+eval_run "million quote" "(car (cdr (cdr '($million))))" 3
+MLISP_PRINT_LENGTH=3 eval_run "million print" "(cdr '($million))" "(2 3 4 ...)"
+
+echo -e "\n== GC test =="
+
+sum="(defun sum (l) (if l (+ (car l) (sum (cdr l))) 0))"
+export MLISP_HEAP_SIZE=1048576
+
+eval_run garbage "(progn $iota $churn (churn 9))" 0
+eval_run live "(progn $iota $churn $sum (let ((l (iota 300))) (progn (churn 8) (sum l))))" 45150
+MLISP_GC_INCREMENTAL=1 eval_run incremental "(progn $iota $churn $sum (let ((l (iota 300))) (progn (churn 8) (sum l))))" 45150
+MLISP_GC_INCREMENTAL=1 MLISP_GC_PAUSE_US=0 eval_run min_pause "(progn $iota $churn $sum (let ((l (iota 300))) (progn (churn 8) (sum l))))" 45150
+batch_run gc_batch "$iota\n=> ()\n(progn $iota $churn (churn 8))\n=> 0\n(progn $iota $churn (churn 8))\n=> 0\n" "3 passed, 0 failed"
+
+unset MLISP_HEAP_SIZE
+
+echo -e "\n== Batch test =="
+
+batch_run batch "(+ 1 2)\n=> 3\n(progn (define x 7) x)\n=> 7\n" "2 passed, 0 failed"
+batch_run comment "; comment\n(car '(1 2))\n=> 1\n" "1 passed, 0 failed"
+batch_run multiline "(progn\n  (defun fn (x y) (+ x y))\n  (fn 10 20))\n=> 30\n" "1 passed, 0 failed"
+batch_run mismatch "(+ 1 2)\n=> 4\n(+ 2 2)\n=> 4\n" "1 passed, 1 failed"
+batch_run fresh_env "(define x 7)\n=> 7\nx\n=> 7\n" "1 passed, 1 failed"
+batch_run error "(undefined 1)\n=> 1\n(+ 1 1)\n=> 2\n" "1 passed, 1 failed"
+batch_run fresh_setq "(setq car 1)\n=> 1\n(car '(1 2))\n=> 1\n" "2 passed, 0 failed"
+batch_run fresh_coroutines "(progn (spawn (lambda () (setq car cdr))) 1)\n=> 1\n(progn (yield) (car '(1 2)))\n=> 1\n" "2 passed, 0 failed"
+batch_run dotimes_args "(dotimes)\n=> 1\n(dolist)\n=> 1\n(+ 1 1)\n=> 2\n" "1 passed, 2 failed"